@@ -2,16 +2,6 @@
 
 namespace kaleidoscope {
 
-int16_t FlashOverride::flashCounter;
-cRGB FlashOverride::flashColor;
-bool FlashOverride::flashWholeKeyboard;
-bool FlashOverride::secondLED;
-uint8_t FlashOverride::flashedLEDRow;
-uint8_t FlashOverride::flashedLEDCol;
-uint8_t FlashOverride::secondLEDRow;
-uint8_t FlashOverride::secondLEDCol;
-cRGB FlashOverride::secondColor;
-
 void FlashOverride::flashLED(byte row, byte col, cRGB crgb) {
   if(flashCounter >= 0) unFlash();
   flashCounter = flashLengthInLoops;
@@ -0,0 +1,28 @@
+/* -*- mode: c++ -*-
+ * Kaleidoscope-MacrosOnTheFly -- Record and play back macros on-the-fly.
+ * Copyright (C) 2017  Craig Disselkoen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <Kaleidoscope-MacrosOnTheFly.h>
+
+// The global MacrosOnTheFly object and its storage live in their own file, so
+//   that sketches which construct their own instance instead don't pay for
+//   them (with dot_a_linkage, this is only linked in if it's referenced)
+
+static byte defaultMacroStorage[kaleidoscope::MacrosOnTheFly::DEFAULT_STORAGE_SIZE_IN_BYTES]
+  __attribute__((aligned(2)));
+
+kaleidoscope::MacrosOnTheFly MacrosOnTheFly(defaultMacroStorage, sizeof(defaultMacroStorage));
@@ -17,53 +17,85 @@
  */
 
 #include <Kaleidoscope-MacrosOnTheFly.h>
+#if MACROSONTHEFLY_LEDS
 #include <Kaleidoscope-LEDControl.h>
+#endif
 #include <kaleidoscope/hid.h>  // wasModifierKeyActive()
 
 #ifdef ARDUINO_VIRTUAL
 #define debug_print(...) printf(__VA_ARGS__)
+#define count_playback(channel, field, n) ((channel).stats.field += (n))
 #else
 #define debug_print(...)
+#define count_playback(channel, field, n) ((void)(n))
 #endif
 
 namespace kaleidoscope {
 
-MacrosOnTheFly::MacrosOnTheFly(void) {
+MacrosOnTheFly::MacrosOnTheFly(byte *storage, const uint16_t size, const Key rec, const Key play)
+  :
+#ifndef MACROSONTHEFLY_MODS_ARE_SLOTS
+  modsAreSlots(false),
+#endif
+#ifndef MACROSONTHEFLY_COLOR_EFFECTS
+  colorEffects(true),
+#endif
+#if MACROSONTHEFLY_LEDS
+  recordColor(CRGB(0,255,0)),
+  slotColor(CRGB(255,255,255)),
+  successColor(CRGB(0,200,0)),
+  failColor(CRGB(200,0,0)),
+  playColor(CRGB(0,255,0)),
+  emptyColor(CRGB(255,0,0)),
+#endif
+  minPlaybackReportInterval(0),
+  macroStorage(storage),
+  storageSize(size),
+  recKey(rec),
+  playKey(play),
+  currentState(IDLE),
+  recording(false),
+  playing(false),
+  reportInterval(0),
+  fastReports(0),
+  lastPlayedKey(Key_NoKey),
+  numBanks(0),
+  useClock(0),
+  writebackSlot(-1),
+  writebackPending(false),
+  nextChannel(0) {
+  for(uint8_t i = 0; i < PLAYBACK_CHANNELS; i++) channels[i].depth = 0;
+  if(storageSize < sizeof(Slot) + sizeof(Entry)) {
+    // not even room for a one-keystroke macro.  Our keys still work (and are
+    //   still swallowed), but findSlot() and newSlot() never find anything
+    storageSize = 0;
+    return;
+  }
   // Initialize the 0th slot to indicate that the rest of the space is free
   Slot* slot = (Slot*)&macroStorage[0];
   slot->key = Key_NoKey;
   slot->previousSlot = -1;  // previousSlot is unsigned, so this will give the max value the type can hold
-  slot->numAllocatedKeystrokes = (STORAGE_SIZE_IN_BYTES - sizeof(Slot)) / sizeof(Entry);
+  slot->bank = NO_BANK;
+  slot->lastUsed = 0;
+  slot->numAllocatedKeystrokes = (storageSize - sizeof(Slot)) / sizeof(Entry);
   slot->numUsedKeystrokes = 0;
 }
 
-// all our (non-const) static member variables
-bool MacrosOnTheFly::modsAreSlots = false;
-bool MacrosOnTheFly::colorEffects = true;
-cRGB MacrosOnTheFly::recordColor = CRGB(0,255,0);
-cRGB MacrosOnTheFly::slotColor = CRGB(255,255,255);
-cRGB MacrosOnTheFly::successColor = CRGB(0,200,0);
-cRGB MacrosOnTheFly::failColor = CRGB(200,0,0);
-cRGB MacrosOnTheFly::playColor = CRGB(0,255,0);
-cRGB MacrosOnTheFly::emptyColor = CRGB(255,0,0);
-byte MacrosOnTheFly::macroStorage[MacrosOnTheFly::STORAGE_SIZE_IN_BYTES];
-MacrosOnTheFly::State MacrosOnTheFly::currentState = MacrosOnTheFly::IDLE;
-bool MacrosOnTheFly::recording = false;
-bool MacrosOnTheFly::playing = false;
-uint16_t MacrosOnTheFly::recordingSlot;
-uint16_t MacrosOnTheFly::lastPlayedSlot = 0;
-KeyAddr MacrosOnTheFly::play_key_addr;
-KeyAddr MacrosOnTheFly::rec_key_addr;
-KeyAddr MacrosOnTheFly::slot_key_addr;
-FlashOverride MacrosOnTheFly::flashOverride;
+void MacrosOnTheFly::setupPersistence(const uint8_t banks) {
+  numBanks = banks;
+  banksBase = ::EEPROMSettings.requestSlice(BANK_SIZE * banks);
+}
 
 bool MacrosOnTheFly::prepareForRecording(const Key key) {
   int16_t index = findSlot(key);
   if(index >= 0) {
     // this key already had a Slot associated with it
     // Clear out any macro that previously existed for this key so we can start anew
+    if(slotIsPlaying(index)) return false;  // can't pull it out from under the playback
+    if(index == writebackSlot) writebackSlot = -1;  // the bank is still marked empty at this point
     free(index);
   }
+  eraseBank(key);
   // At this point we know there is no Slot associated with this key
   index = newSlot(key);
   if(index < 0) return false;  // not enough room to create a new Slot
@@ -78,34 +110,47 @@ void MacrosOnTheFly::free(const uint16_t index) {
     // don't actually delete the Slot structure, just mark it all as extra space
     slot->key = Key_NoKey;
     slot->numUsedKeystrokes = 0;
+    slot->bank = NO_BANK;
   } else {
     // give all this slot's space, plus the space taken up by its Slot structure itself, to previous Slot
     Slot* previousSlot = (Slot*)&macroStorage[slot->previousSlot];
     uint16_t bytesToGive = sizeof(Slot) + sizeof(Entry)*slot->numAllocatedKeystrokes;
     previousSlot->numAllocatedKeystrokes += bytesToGive / sizeof(Entry);
+    // the Slot after this one (if any) now follows the previous Slot
+    uint16_t nextIndex = index + bytesToGive;
+    if(nextIndex <= storageSize-sizeof(Slot)) {
+      ((Slot*)&macroStorage[nextIndex])->previousSlot = slot->previousSlot;
+    }
   }
 }
 
 int16_t MacrosOnTheFly::findSlot(const Key key) {
+  if(storageSize == 0) return -1;  // see the constructor
   uint16_t index = 0;
   while(true) {
     Slot* slot = (Slot*)&macroStorage[index];
     if(slot->key == key) return index;
     index += sizeof(Slot) + sizeof(Entry)*slot->numAllocatedKeystrokes;
-    if(index > STORAGE_SIZE_IN_BYTES-sizeof(Slot)) return -1;
+    if(index > storageSize-sizeof(Slot)) return -1;
   }
 }
 
-int16_t MacrosOnTheFly::newSlot(const Key key) {
-  const uint16_t index = getSlotWithMostFreeSpace();
-  const uint16_t freeSpace = getFreeSpace(index);  // technically getSlotWithMostFreeSpace() already computed this
-  if(freeSpace < sizeof(Slot) + sizeof(Entry)) return false;  // not enough room for a 1-keystroke macro
+int16_t MacrosOnTheFly::newSlot(const Key key, const uint8_t wantedKeystrokes) {
+  if(storageSize == 0) return -1;  // see the constructor
+  uint16_t index = getSlotWithMostFreeSpace();
+  uint16_t freeSpace = getFreeSpace(index);  // technically getSlotWithMostFreeSpace() already computed this
+  while(freeSpace < sizeof(Slot) + sizeof(Entry)*wantedKeystrokes && evictSlot()) {
+    index = getSlotWithMostFreeSpace();
+    freeSpace = getFreeSpace(index);
+  }
+  if(freeSpace < sizeof(Slot) + sizeof(Entry)) return -1;  // not enough room for a 1-keystroke macro
 
   Slot* slot = (Slot*)&macroStorage[index];
   if(slot->key == Key_NoKey) {
     // take over this Slot entirely
     slot->key = key;
-    // numUsedKeystrokes is already 0 - this is a property of Key_NoKey Slots
+    slot->lastUsed = useClock++;
+    // numUsedKeystrokes is already 0 and bank is already NO_BANK - these are properties of Key_NoKey Slots
     return index;
   } else {
     // allocate ourselves a Slot using all of this one's free space
@@ -116,6 +161,13 @@ int16_t MacrosOnTheFly::newSlot(const Key key) {
     newSlot->previousSlot = index;
     newSlot->numAllocatedKeystrokes = (freeSpace - sizeof(Slot)) / sizeof(Entry);
     newSlot->numUsedKeystrokes = 0;
+    newSlot->bank = NO_BANK;
+    newSlot->lastUsed = useClock++;
+    // the Slot after the new one (if any) now follows the new one
+    uint16_t nextIndex = newIndex + sizeof(Slot) + sizeof(Entry)*newSlot->numAllocatedKeystrokes;
+    if(nextIndex <= storageSize-sizeof(Slot)) {
+      ((Slot*)&macroStorage[nextIndex])->previousSlot = newIndex;
+    }
     return newIndex;
   }
 }
@@ -132,7 +184,7 @@ uint16_t MacrosOnTheFly::getSlotWithMostFreeSpace() {
     }
     Slot* slot = (Slot*)&macroStorage[index];
     index += sizeof(Slot) + sizeof(Entry)*slot->numAllocatedKeystrokes;
-    if(index > STORAGE_SIZE_IN_BYTES-sizeof(Slot)) return winningSlot;
+    if(index > storageSize-sizeof(Slot)) return winningSlot;
   }
 }
 
@@ -143,12 +195,153 @@ uint16_t MacrosOnTheFly::getFreeSpace(uint16_t index) {
   return freeSpace;
 }
 
-bool MacrosOnTheFly::recordKeystroke(const Key key, const uint8_t key_state) {
-  if(!keyToggledOn(key_state) && !keyToggledOff(key_state)) {
-    // we only care about toggle events. Carry on.
-    return true;
+bool MacrosOnTheFly::isEvictable(const uint16_t index) {
+  Slot* slot = (Slot*)&macroStorage[index];
+  // Only clean Slots can be evicted (this excludes recordingSlot and
+  //   writebackSlot)
+  return slot->bank != NO_BANK && slot->key != Key_NoKey;
+}
+
+bool MacrosOnTheFly::evictSlot() {
+  int16_t victim = -1;
+  uint8_t victimAge = 0;
+  uint16_t index = 0;
+  while(true) {
+    Slot* slot = (Slot*)&macroStorage[index];
+    // a Slot being played (in any channel) has to stay where it is
+    if(isEvictable(index) && !slotIsPlaying(index)) {
+      uint8_t age = useClock - slot->lastUsed;
+      if(victim < 0 || age > victimAge) {
+        victim = index;
+        victimAge = age;
+      }
+    }
+    index += sizeof(Slot) + sizeof(Entry)*slot->numAllocatedKeystrokes;
+    if(index > storageSize-sizeof(Slot)) break;
   }
+  if(victim < 0) return false;
+  debug_print("MacrosOnTheFly: evicting slot at %d\n", victim);
+  free(victim);
+  return true;
+}
+
+int16_t MacrosOnTheFly::findBank(const Key key) {
+  for(uint8_t bank = 0; bank < numBanks; bank++) {
+    const uint16_t address = banksBase + BANK_SIZE*bank;
+    const uint8_t numKeystrokes = Kaleidoscope.storage().read(address + 2);
+    if(numKeystrokes == 0 || numKeystrokes > BANK_KEYSTROKES) continue;  // empty bank
+    const uint16_t raw = Kaleidoscope.storage().read(address) | (Kaleidoscope.storage().read(address + 1) << 8);
+    if(raw == key.getRaw()) return bank;
+  }
+  return -1;
+}
 
+int16_t MacrosOnTheFly::findEmptyBank() {
+  for(uint8_t bank = 0; bank < numBanks; bank++) {
+    const uint8_t numKeystrokes = Kaleidoscope.storage().read(banksBase + BANK_SIZE*bank + 2);
+    if(numKeystrokes == 0 || numKeystrokes > BANK_KEYSTROKES) return bank;
+  }
+  return -1;
+}
+
+void MacrosOnTheFly::eraseBank(const Key key) {
+  const int16_t bank = findBank(key);
+  if(bank < 0) return;
+  // a single byte write, so it's fine to do this right away
+  Kaleidoscope.storage().update(banksBase + BANK_SIZE*bank + 2, 0);
+  Kaleidoscope.storage().commit();
+}
+
+int16_t MacrosOnTheFly::faultInSlot(const Key key) {
+  const int16_t bank = findBank(key);
+  if(bank < 0) return -1;
+  const uint16_t address = banksBase + BANK_SIZE*bank;
+  const uint8_t numKeystrokes = Kaleidoscope.storage().read(address + 2);
+  const int16_t index = newSlot(key, numKeystrokes);
+  if(index < 0) return -1;
+  Slot* slot = (Slot*)&macroStorage[index];
+  if(slot->numAllocatedKeystrokes < numKeystrokes) {
+    // couldn't evict enough to make room for it
+    free(index);
+    return -1;
+  }
+  for(uint8_t i = 0; i < numKeystrokes; i++) {
+    const uint16_t entryAddress = address + BANK_HEADER_SIZE + BANK_ENTRY_SIZE*i;
+    Entry& entry = slot->keystrokes[i];
+    entry.key.setRaw(Kaleidoscope.storage().read(entryAddress) | (Kaleidoscope.storage().read(entryAddress + 1) << 8));
+    entry.state = Kaleidoscope.storage().read(entryAddress + 2);
+  }
+  slot->numUsedKeystrokes = numKeystrokes;
+  slot->bank = bank;
+  debug_print("MacrosOnTheFly: loaded %u keystrokes from bank %d\n", numKeystrokes, bank);
+  return index;
+}
+
+void MacrosOnTheFly::startNextWriteback() {
+  writebackPending = false;
+  uint16_t index = 0;
+  while(true) {
+    Slot* slot = (Slot*)&macroStorage[index];
+    // empty macros don't need a bank, long ones don't fit in one, and the one
+    //   being recorded isn't finished yet
+    if(slot->key != Key_NoKey && slot->bank == NO_BANK
+        && slot->numUsedKeystrokes > 0 && slot->numUsedKeystrokes <= BANK_KEYSTROKES
+        && !(recording && index == recordingSlot)) {
+      const int16_t bank = findEmptyBank();
+      if(bank < 0) return;  // all banks in use; this macro stays in RAM only
+      writebackSlot = index;
+      writebackBank = bank;
+      writebackStep = 0;
+      // there may be more after this one
+      writebackPending = true;
+      return;
+    }
+    index += sizeof(Slot) + sizeof(Entry)*slot->numAllocatedKeystrokes;
+    if(index > storageSize-sizeof(Slot)) return;
+  }
+}
+
+void MacrosOnTheFly::stepWriteback() {
+  if(writebackSlot < 0) {
+    if(!writebackPending || numBanks == 0) return;
+    startNextWriteback();
+    if(writebackSlot < 0) return;
+  }
+  Slot* slot = (Slot*)&macroStorage[writebackSlot];
+  const uint16_t address = banksBase + BANK_SIZE*writebackBank;
+  const uint16_t lastStep = BANK_HEADER_SIZE + BANK_ENTRY_SIZE*slot->numUsedKeystrokes;
+
+  if(writebackStep == 0) {
+    // mark the bank empty until we're done
+    Kaleidoscope.storage().update(address + 2, 0);
+  } else if(writebackStep < lastStep) {
+    // steps 1 and 2 write the key; after that, step N writes byte N of the bank
+    const uint16_t offset = writebackStep < BANK_HEADER_SIZE ? writebackStep - 1 : writebackStep;
+    uint16_t raw;
+    uint8_t byteInField;
+    if(offset < BANK_HEADER_SIZE) {
+      raw = slot->key.getRaw();
+      byteInField = offset;
+    } else {
+      const Entry& entry = slot->keystrokes[(offset - BANK_HEADER_SIZE) / BANK_ENTRY_SIZE];
+      raw = entry.key.getRaw();
+      byteInField = (offset - BANK_HEADER_SIZE) % BANK_ENTRY_SIZE;
+      if(byteInField == 2) raw = entry.state;
+    }
+    Kaleidoscope.storage().update(address + offset, byteInField == 1 ? raw >> 8 : raw & 0xff);
+  } else {
+    // everything else is in place; writing numUsedKeystrokes makes the bank valid
+    Kaleidoscope.storage().update(address + 2, slot->numUsedKeystrokes);
+    Kaleidoscope.storage().commit();
+    slot->bank = writebackBank;
+    writebackSlot = -1;
+    debug_print("MacrosOnTheFly: wrote back %u keystrokes to bank %u\n", slot->numUsedKeystrokes, writebackBank);
+    return;
+  }
+  writebackStep++;
+}
+
+bool MacrosOnTheFly::recordKeystroke(const Key key, const uint8_t key_state) {
   Slot* slot = (Slot*)&macroStorage[recordingSlot];
 
   if(keyToggledOff(key_state)) {  // i.e. this is an UP
@@ -168,7 +361,11 @@ bool MacrosOnTheFly::recordKeystroke(const Key key, const uint8_t key_state) {
     }
   }
 
-  if(slot->numUsedKeystrokes == slot->numAllocatedKeystrokes) {
+  if(slot->numUsedKeystrokes == slot->numAllocatedKeystrokes && slot->numUsedKeystrokes < 255) {
+    if(growRecordingSlot()) slot = (Slot*)&macroStorage[recordingSlot];  // it may have moved
+  }
+
+  if(slot->numUsedKeystrokes == slot->numAllocatedKeystrokes || slot->numUsedKeystrokes == 255) {
     // no more room
     debug_print("MacrosOnTheFly: recordKeystroke: no room, used = allocated = %u\n", slot->numUsedKeystrokes);
     free(recordingSlot);
@@ -181,37 +378,226 @@ bool MacrosOnTheFly::recordKeystroke(const Key key, const uint8_t key_state) {
   return true;
 }
 
-bool MacrosOnTheFly::play(const uint16_t index) {
-  Key pressedKeys[MAX_SIMULTANEOUS_HELD_KEYS];
-  clearPressedKeys(pressedKeys);
+bool MacrosOnTheFly::growRecordingSlot() {
+  Slot* slot = (Slot*)&macroStorage[recordingSlot];
+  // if the next Slot is only a cached copy, we can take its space
+  const uint16_t nextIndex = recordingSlot + sizeof(Slot) + sizeof(Entry)*slot->numAllocatedKeystrokes;
+  if(nextIndex <= storageSize-sizeof(Slot) && isEvictable(nextIndex) && !slotIsPlaying(nextIndex)) {
+    debug_print("MacrosOnTheFly: evicting slot at %u to grow recording\n", nextIndex);
+    free(nextIndex);  // gives its space to the previous Slot, i.e. recordingSlot
+    return true;
+  }
+
+  // Otherwise, evict clean Slots (wherever they are) until there is somewhere
+  //   with room for the whole recording plus one more keystroke, and move it
+  //   there.  That can also be where it already is, together with the free
+  //   space before it.  A Slot being played has to stay where it is, though.
+  if(slotIsPlaying(recordingSlot)) return false;
+  const uint16_t wantedSpace = sizeof(Slot) + sizeof(Entry)*(slot->numUsedKeystrokes + 1);
+  while(true) {
+    uint16_t room = sizeof(Slot) + sizeof(Entry)*slot->numAllocatedKeystrokes;
+    if(recordingSlot != 0) room += getFreeSpace(slot->previousSlot);
+    const uint16_t freeSpace = getFreeSpace(getSlotWithMostFreeSpace());
+    if(freeSpace > room) room = freeSpace;
+    if(room >= wantedSpace) break;
+    if(!evictSlot()) return false;
+    // the evicted Slot may have been the one after recordingSlot after all
+    if(slot->numUsedKeystrokes < slot->numAllocatedKeystrokes) return true;
+  }
+
+  const Key key = slot->key;
+  const uint8_t numKeystrokes = slot->numUsedKeystrokes;
+  const uint16_t oldIndex = recordingSlot;
+  // Freeing the Slot leaves its keystrokes where they are; and newSlot() can
+  //   only put the new Slot elsewhere, or lower down over the old one, so
+  //   copying them over in order is safe.
+  free(oldIndex);
+  const int16_t index = newSlot(key, numKeystrokes + 1);
+  if(index < 0) return false;  // can't happen, since we made room above
+  const Entry* from = (const Entry*)&macroStorage[oldIndex + sizeof(Slot)];
+  Slot* moved = (Slot*)&macroStorage[index];
+  for(uint8_t i = 0; i < numKeystrokes; i++) moved->keystrokes[i] = from[i];
+  moved->numUsedKeystrokes = numKeystrokes;
+  recordingSlot = index;
+  debug_print("MacrosOnTheFly: moved recording from %u to %d\n", oldIndex, index);
+  return true;
+}
+
+bool MacrosOnTheFly::startPlayback(const uint16_t index) {
   Slot* slot = (Slot*)&macroStorage[index];
-  for(uint8_t i = 0; i < slot->numUsedKeystrokes; i++) {
-    Entry& entry = slot->keystrokes[i];
-    if(keyIsPressed(entry.state)) {
-      handleKeyswitchEvent(entry.key, UnknownKeyswitchLocation, IS_PRESSED);
-      Kaleidoscope.hid().keyboard().sendReport();
-      addToPressedKeys(entry.key, pressedKeys);
+  if(slot->numUsedKeystrokes == 0) return false;
+  uint8_t c;
+  if(playing) {
+    // nested inside the macro we're playing; it continues in the same channel
+    c = activeChannel;
+    if(channels[c].depth == MAX_PLAYBACK_DEPTH) return false;
+  } else {
+    for(c = 0; c < PLAYBACK_CHANNELS; c++) {
+      if(channels[c].depth == 0) break;
+    }
+    if(c == PLAYBACK_CHANNELS) return false;  // all channels busy
+    clearPressedKeys(channels[c]);
+#ifdef ARDUINO_VIRTUAL
+    channels[c].stats = PlaybackStats{0, 0, 0};
+#endif
+  }
+  debug_print("MacrosOnTheFly: channel %u: playing slot at %u, depth %u\n", c, index, channels[c].depth + 1);
+  slot->lastUsed = useClock++;
+  PlaybackFrame& frame = channels[c].frames[channels[c].depth++];
+  frame.slot = index;
+  frame.nextKeystroke = 0;
+  frame.pressDone = false;
+  return true;
+}
+
+void MacrosOnTheFly::stopPlayback(const uint8_t c) {
+  if(channels[c].depth == 0) return;
+  channels[c].depth = 0;
+  // take its keys out of the report, leaving the user's and other channels'
+  for(uint8_t i = 0; i < MAX_SIMULTANEOUS_HELD_KEYS; i++) {
+    if(channels[c].pressedKeys[i].getRaw() == Key_NoKey.getRaw()) break;
+    Kaleidoscope.hid().keyboard().releaseKey(channels[c].pressedKeys[i]);
+  }
+  pressHeldKeys();
+  sendPlaybackReport();
+  count_playback(channels[c], reports, 1);
+  debug_print("MacrosOnTheFly: channel %u: stopped\n", c);
+  printPlaybackStats(c);
+}
+
+#ifdef ARDUINO_VIRTUAL
+void MacrosOnTheFly::printPlaybackStats(const uint8_t c) {
+  debug_print("MacrosOnTheFly: channel %u: %u reports, %u events, %u cycles\n",
+              c, channels[c].stats.reports, channels[c].stats.events, channels[c].stats.cycles);
+}
+#endif
+
+bool MacrosOnTheFly::isPlaybackActive() {
+  for(uint8_t c = 0; c < PLAYBACK_CHANNELS; c++) {
+    if(channels[c].depth > 0) return true;
+  }
+  return false;
+}
+
+bool MacrosOnTheFly::slotIsPlaying(const uint16_t index) {
+  for(uint8_t c = 0; c < PLAYBACK_CHANNELS; c++) {
+    for(uint8_t i = 0; i < channels[c].depth; i++) {
+      if(channels[c].frames[i].slot == index) return true;
+    }
+  }
+  return false;
+}
+
+void MacrosOnTheFly::stepPlayback() {
+  // If the user is choosing a slot, wait: otherwise our keystrokes would be
+  //   taken as their choice
+  if(currentState != IDLE) return;
+  for(uint8_t c = 0; c < PLAYBACK_CHANNELS; c++) {
+    if(channels[c].depth > 0) count_playback(channels[c], cycles, 1);
+  }
+  uint8_t reports = 0;
+  uint8_t freeInARow = 0;  // once every channel in turn is free, we're done
+  while(freeInARow < PLAYBACK_CHANNELS) {
+    if(reports >= MAX_REPORTS_PER_CYCLE) break;
+    if(micros() - lastReportTime < playbackReportInterval()) break;
+    const uint8_t c = nextChannel;
+    nextChannel = (nextChannel + 1) % PLAYBACK_CHANNELS;
+    if(channels[c].depth == 0) {
+      freeInARow++;
+      continue;
+    }
+    freeInARow = 0;
+    reports += stepChannel(c);
+  }
+}
+
+uint8_t MacrosOnTheFly::stepChannel(const uint8_t c) {
+  PlaybackChannel& channel = channels[c];
+  uint8_t reports = 0;
+  playing = true;
+  activeChannel = c;
+  // A nested MACROPLAY from the macro itself leaves us picking a slot, and
+  //   the macro's next keystroke is the choice; so never stop in between
+  do {
+    PlaybackFrame& frame = channel.frames[channel.depth-1];
+    Slot* slot = (Slot*)&macroStorage[frame.slot];
+    if(frame.nextKeystroke >= slot->numUsedKeystrokes) {
+      channel.depth--;
+      // release any keys this frame's macro left held, so they don't leak into
+      //   the rest of the outer macro (at the end of the top-level macro, this
+      //   is all of this channel's keys)
+      if(releaseFrameKeys(channel) || channel.depth == 0) {
+        pressHeldKeys();
+        sendPlaybackReport();
+        reports++;
+        count_playback(channel, reports, 1);
+      }
+      if(channel.depth == 0) printPlaybackStats(c);
+      continue;
     }
-    if(keyWasPressed(entry.state)) {
+    // Update the frame before injecting anything, since the injected key may
+    //   start a nested macro
+    const Entry entry = slot->keystrokes[frame.nextKeystroke];
+    if(keyIsPressed(entry.state) && !frame.pressDone) {
+      if(keyWasPressed(entry.state)) frame.pressDone = true;  // a TAP; release it next time
+      else frame.nextKeystroke++;
+      // If this key chooses a slot (after a nested MACROPLAY or MACROREC), it
+      //   is consumed; don't go on pressing it afterwards, whether or not it
+      //   actually started a nested macro.  Modifiers passed through while
+      //   picking (when they aren't slots) don't choose one, and are held
+      //   like any other key.
+      const bool picking = currentState != IDLE;
+      handleKeyswitchEvent(entry.key, UnknownKeyswitchLocation, IS_PRESSED);
+      count_playback(channel, events, 1);
+      sendPlaybackReport();
+      if(!picking || currentState != IDLE) addToPressedKeys(entry.key, channel);
+    } else {
+      frame.pressDone = false;
+      frame.nextKeystroke++;
       handleKeyswitchEvent(entry.key, UnknownKeyswitchLocation, WAS_PRESSED);
-      removeFromPressedKeys(entry.key, pressedKeys);
-      // Since we're injecting keyswitch events without the INJECTED flag,
-      //   release events may not properly register if we simply inject like this.
-      // Therefore, we simulate the Kaleidoscope core's "new scan cycle"
-      //   process after every release event - namely, we clear all keys and
-      //   re-press the held ones.
-      Kaleidoscope.hid().keyboard().releaseAllKeys();
-      pressPressedKeys(pressedKeys);
-      Kaleidoscope.hid().keyboard().sendReport();
+      count_playback(channel, events, 1);
+      removeFromPressedKeys(entry.key, channel);
+      // A release event doesn't take the key out of the report by itself (the
+      //   core only ever clears the whole report, between cycles), so we take
+      //   it out ourselves.  Only this key, so that the keys the user is
+      //   holding stay in; then re-press the keys still held by playback (for
+      //   every channel), in case any of them shared a modifier with it.
+      Kaleidoscope.hid().keyboard().releaseKey(entry.key);
+      pressHeldKeys();
+      sendPlaybackReport();
+    }
+    reports++;
+    count_playback(channel, reports, 1);
+  } while(currentState != IDLE && channel.depth > 0);
+  playing = false;
+  return reports;
+}
+
+void MacrosOnTheFly::pressHeldKeys() {
+  for(uint8_t c = 0; c < PLAYBACK_CHANNELS; c++) {
+    if(channels[c].depth > 0) {
+      const uint8_t pressed = pressPressedKeys(channels[c]);
+      count_playback(channels[c], events, pressed);
     }
   }
-  // release all keys at macro end
-  Kaleidoscope.hid().keyboard().releaseAllKeys();
+}
+
+void MacrosOnTheFly::sendPlaybackReport() {
+  const uint32_t start = micros();
   Kaleidoscope.hid().keyboard().sendReport();
-  return (slot->numUsedKeystrokes > 0);
+  lastReportTime = micros();
+  if(lastReportTime - start > STALL_THRESHOLD_US) {
+    // the host was slow to take that report; slow down
+    reportInterval = reportInterval < MAX_REPORT_INTERVAL_US / 2 ? reportInterval * 2 + BACKOFF_STEP_US : MAX_REPORT_INTERVAL_US;
+    fastReports = 0;
+    debug_print("MacrosOnTheFly: report stalled, interval now %u us\n", reportInterval);
+  } else if(reportInterval > 0 && ++fastReports == RAMP_UP_AFTER) {
+    reportInterval /= 2;
+    fastReports = 0;
+  }
 }
 
-void MacrosOnTheFly::addToPressedKeys(Key key, Key* pressedKeys) {
+void MacrosOnTheFly::addToPressedKeys(Key key, PlaybackChannel& channel) {
   // An implicit assumption is that no key appears twice in pressedKeys.
   //   (This assumption is important in removeFromPressedKeys() below.)
   // Caller is responsible for making sure they don't call addToPressedKeys()
@@ -219,10 +605,11 @@ void MacrosOnTheFly::addToPressedKeys(Key key, Key* pressedKeys) {
   //   impossible - we can't have two D events for the same key without a U
   //   event in between.
   for(uint8_t i = 0; i < MAX_SIMULTANEOUS_HELD_KEYS; i++) {
-    if(pressedKeys[i].getRaw() == Key_NoKey.getRaw()) {
-      pressedKeys[i].setRaw(key.getRaw());
+    if(channel.pressedKeys[i].getRaw() == Key_NoKey.getRaw()) {
+      channel.pressedKeys[i].setRaw(key.getRaw());
+      channel.pressedDepths[i] = channel.depth;
       i++;
-      if(i < MAX_SIMULTANEOUS_HELD_KEYS) pressedKeys[i].setRaw(Key_NoKey.getRaw());
+      if(i < MAX_SIMULTANEOUS_HELD_KEYS) channel.pressedKeys[i].setRaw(Key_NoKey.getRaw());
       break;
     }
   }
@@ -233,29 +620,58 @@ void MacrosOnTheFly::addToPressedKeys(Key key, Key* pressedKeys) {
   //   MacrosOnTheFly.h
 }
 
-void MacrosOnTheFly::removeFromPressedKeys(Key key, Key* pressedKeys) {
-  bool copying = false;
+void MacrosOnTheFly::removeFromPressedKeys(Key key, PlaybackChannel& channel) {
   for(uint8_t i = 0; i < MAX_SIMULTANEOUS_HELD_KEYS; i++) {
-    if(copying) pressedKeys[i].setRaw(pressedKeys[i+1].getRaw());
-    if(pressedKeys[i].getRaw() == Key_NoKey.getRaw()) break;
-    if(pressedKeys[i].getRaw() == key.getRaw()) {
-      copying = true;
-      pressedKeys[i].setRaw(pressedKeys[i+1].getRaw());
+    if(channel.pressedKeys[i].getRaw() == Key_NoKey.getRaw()) break;
+    if(channel.pressedKeys[i].getRaw() == key.getRaw()) {
+      removePressedKeyAt(i, channel);
+      break;
     }
   }
 }
 
-void MacrosOnTheFly::pressPressedKeys(Key* pressedKeys) {
-  for(uint8_t i = 0; i < MAX_SIMULTANEOUS_HELD_KEYS; i++) {
-    Key key = pressedKeys[i];
+void MacrosOnTheFly::removePressedKeyAt(uint8_t i, PlaybackChannel& channel) {
+  // shift the rest of the list (including its NoKey terminator, if any) down
+  for(; i < MAX_SIMULTANEOUS_HELD_KEYS - 1; i++) {
+    channel.pressedKeys[i].setRaw(channel.pressedKeys[i+1].getRaw());
+    channel.pressedDepths[i] = channel.pressedDepths[i+1];
+    if(channel.pressedKeys[i].getRaw() == Key_NoKey.getRaw()) return;
+  }
+  channel.pressedKeys[i].setRaw(Key_NoKey.getRaw());
+}
+
+bool MacrosOnTheFly::releaseFrameKeys(PlaybackChannel& channel) {
+  // keys pressed by the frame that just ended have a depth greater than the
+  //   channel's (already decremented) depth
+  bool released = false;
+  uint8_t i = 0;
+  while(i < MAX_SIMULTANEOUS_HELD_KEYS && channel.pressedKeys[i].getRaw() != Key_NoKey.getRaw()) {
+    if(channel.pressedDepths[i] > channel.depth) {
+      handleKeyswitchEvent(channel.pressedKeys[i], UnknownKeyswitchLocation, WAS_PRESSED);
+      Kaleidoscope.hid().keyboard().releaseKey(channel.pressedKeys[i]);
+      count_playback(channel, events, 1);
+      removePressedKeyAt(i, channel);
+      released = true;
+    } else {
+      i++;
+    }
+  }
+  return released;
+}
+
+uint8_t MacrosOnTheFly::pressPressedKeys(PlaybackChannel& channel) {
+  uint8_t i;
+  for(i = 0; i < MAX_SIMULTANEOUS_HELD_KEYS; i++) {
+    Key key = channel.pressedKeys[i];
     if(key.getRaw() == Key_NoKey.getRaw()) break;
     handleKeyswitchEvent(key, UnknownKeyswitchLocation, IS_PRESSED | WAS_PRESSED);
       // IS_PRESSED | WAS_PRESSED indicates "still held"
   }
+  return i;
 }
 
-void MacrosOnTheFly::clearPressedKeys(Key* pressedKeys) {
-  pressedKeys[0].setRaw(Key_NoKey.getRaw());
+void MacrosOnTheFly::clearPressedKeys(PlaybackChannel& channel) {
+  channel.pressedKeys[0].setRaw(Key_NoKey.getRaw());
 }
 
 // Returns TRUE for modifier or layer keys
@@ -266,32 +682,46 @@ static bool isModifier(Key key) {
     (key.getFlags() == (SYNTHETIC | SWITCH_TO_KEYMAP));
 }
 
-// Adds flags to the 'flags' field of the key according to what is currently held
-static void addModifierFlags(Key* key) {
+// Returns the flags for the 'flags' field of a key according to what is currently held
+static uint8_t modifierFlagsFromReport() {
   // we use wasModifierKeyActive() rather than isModifierKeyActive() because the
   //   latter may not be accurate yet for this scan cycle
+  uint8_t flags = 0;
 
   if(Kaleidoscope.hid().keyboard().wasModifierKeyActive(Key_LeftControl)
       || Kaleidoscope.hid().keyboard().wasModifierKeyActive(Key_RightControl))
-    key->setFlags(key->getFlags() | CTRL_HELD);
+    flags |= CTRL_HELD;
   if(Kaleidoscope.hid().keyboard().wasModifierKeyActive(Key_LeftShift)
       || Kaleidoscope.hid().keyboard().wasModifierKeyActive(Key_RightShift))
-    key->setFlags(key->getFlags() | SHIFT_HELD);
+    flags |= SHIFT_HELD;
   if(Kaleidoscope.hid().keyboard().wasModifierKeyActive(Key_LeftAlt))
-    key->setFlags(key->getFlags() | LALT_HELD);
+    flags |= LALT_HELD;
   if(Kaleidoscope.hid().keyboard().wasModifierKeyActive(Key_RightAlt))
-    key->setFlags(key->getFlags() | RALT_HELD);
+    flags |= RALT_HELD;
   if(Kaleidoscope.hid().keyboard().wasModifierKeyActive(Key_LeftGui)
       || Kaleidoscope.hid().keyboard().wasModifierKeyActive(Key_RightGui))
-    key->setFlags(key->getFlags() | GUI_HELD);
+    flags |= GUI_HELD;
+  return flags;
 }
 
 kaleidoscope::EventHandlerResult MacrosOnTheFly::onKeyswitchEvent(Key &mapped_key, KeyAddr key_addr, uint8_t key_state) {
-  /* NOTE: this function alone, and not any of its callees, is responsible for
-   *   the upkeep of the variables 'currentState', 'recording', 'playing', and
-   *   'lastPlayedSlot'.  No other function should modify them.
+  /* NOTE: this function and its on*() helpers, and not any of their other
+   *   callees, are responsible for the upkeep of the variables
+   *   'currentState', 'recording', 'playing', and 'lastPlayedKey'.  No other
+   *   function should modify them.
    */
 
+  /* Fast path: this runs for every held key on every scan cycle, but we only
+   *   ever take action on toggle events.  The one thing we do with other
+   *   events is swallow our own keys while idle, so they aren't passed on as
+   *   keystrokes.
+   */
+  if(!keyToggledOn(key_state) && !keyToggledOff(key_state)) {
+    if(currentState == IDLE && (mapped_key.getRaw() == recKey.getRaw() || mapped_key.getRaw() == playKey.getRaw()))
+      return kaleidoscope::EventHandlerResult::EVENT_CONSUMED;
+    return kaleidoscope::EventHandlerResult::OK;
+  }
+
   /* Injected keys:
    * While we're recording a macro, we don't want to record injected keys.  We'll record only
    *   the keys pressed by the user, and then during playback those keys will inject the same
@@ -321,38 +751,27 @@ kaleidoscope::EventHandlerResult MacrosOnTheFly::onKeyswitchEvent(Key &mapped_ke
 
   bool isInjected = (key_state & INJECTED) || playing;  // see notes above
 
-  if(currentState == PICKING_SLOT_FOR_REC) {
-    if(!keyToggledOn(key_state)) return kaleidoscope::EventHandlerResult::OK;  // we only take action on ToggledOn events
-    if(!modsAreSlots && isModifier(mapped_key)) {
-      // if this is a modifier, and we're not using modifiers as slots
-      //   themselves, then just let the modifier be handled normally -
-      //   it could be used to modify the slot-choice key
-      return kaleidoscope::EventHandlerResult::OK;
-    }
-    if(mapped_key.getRaw() == MACROPLAY) {
-      if(colorEffects) LED_record_fail(key_addr.row(), key_addr.col());  // Trying to record into the PLAY slot is error
-    } else {
-      addModifierFlags(&mapped_key);
-      recording = prepareForRecording(mapped_key);
-      if(recording) {
-        slot_key_addr = key_addr;
-      }
-      if(!recording && colorEffects) LED_record_fail(key_addr.row(), key_addr.col());
-    }
-    currentState = IDLE;
-    // mask out this key until it is released, so that we don't accidentally include it in the
-    //   recorded macro, or (if recording failed) it doesn't register as a keystroke
-    Kaleidoscope.device().maskKey(key_addr);
-    return kaleidoscope::EventHandlerResult::EVENT_CONSUMED;
+  switch(currentState) {
+    case PICKING_SLOT_FOR_REC:
+      return onPickingSlotForRec(mapped_key, key_addr, key_state);
+    case PICKING_SLOT_FOR_PLAY:
+      if(recording && !isInjected) onRecordingKeystroke(mapped_key, key_addr, key_state);
+      return onPickingSlotForPlay(mapped_key, key_addr, key_state);
+    case IDLE:
+    default:
+      return onIdle(mapped_key, key_addr, key_state, isInjected);
   }
+}
 
-  if(currentState == IDLE && mapped_key.getRaw() == MACROREC) {
+kaleidoscope::EventHandlerResult MacrosOnTheFly::onIdle(Key &mapped_key, KeyAddr key_addr, uint8_t key_state, bool isInjected) {
+  if(mapped_key.getRaw() == recKey.getRaw()) {
     if(keyToggledOn(key_state) && !isInjected) {
       // we only take action on ToggledOn events; and we don't enter recording mode
-      //   during playback (see notes on injected keys at the top of this function)
+      //   during playback (see notes on injected keys in onKeyswitchEvent())
       rec_key_addr = key_addr;
       if(recording) {
         recording = false;
+        writebackPending = true;
         if(colorEffects) LED_record_success(key_addr.row(), key_addr.col());
       } else {
         currentState = PICKING_SLOT_FOR_REC;
@@ -361,54 +780,9 @@ kaleidoscope::EventHandlerResult MacrosOnTheFly::onKeyswitchEvent(Key &mapped_ke
     return kaleidoscope::EventHandlerResult::EVENT_CONSUMED;  // in any case, the key has been handled
   }
 
-  if(recording && !isInjected) {
-    // Any key other than (idle) MACROREC during recording is recorded.
-    // In particular, MACROPLAY is still recorded.  This means you can nest our macros,
-    //   i.e. you can playback an on-the-fly macro as part of another on-the-fly macro.
-    // This is a cool feature which we get for free with this ordering.
-    // We also don't record injected keys - see comments at the top of this function
-    recording = recordKeystroke(mapped_key, key_state);
-    if(!recording && colorEffects) LED_record_fail(key_addr.row(), key_addr.col());
-    // Keys typed during recording should also be handled normally (including keys
-    // controlling macro playback), so we fall through and continue handling the keys
-    // as normal, through the macro-playback hooks below or else by the 'return
-    // mapped_key' at the end.
-  }
-
-  if(currentState == PICKING_SLOT_FOR_PLAY) {
-    if(!keyToggledOn(key_state)) return kaleidoscope::EventHandlerResult::OK;  // we only take action on ToggledOn events
-    if(!modsAreSlots && isModifier(mapped_key)) {
-      // if this is a modifier, and we're not using modifiers as slots
-      //   themselves, then just let the modifier be handled normally -
-      //   it could be used to modify the slot-choice key
-      return kaleidoscope::EventHandlerResult::OK;
-    }
-    addModifierFlags(&mapped_key);
-    // at this point, we have selected a slot and will play a macro
-    currentState = IDLE;  // do this first, so keypresses injected by playing the macro get handled with currentState==IDLE
-    playing = true;
-    bool success;
-    if(mapped_key.getRaw() == MACROPLAY) {
-      success = play(lastPlayedSlot);
-    } else {
-      int16_t index = findSlot(mapped_key);
-      success = index >= 0 && play(index);
-      if(success) lastPlayedSlot = index;
-      // we ensure that lastPlayedSlot always points to a valid Slot
-      //   (and not, for instance, -1)
-    }
-    playing = false;
-    if(colorEffects) {
-      if(success) LED_play_success(key_addr.row(), key_addr.col());
-      else LED_play_fail(key_addr.row(), key_addr.col());
-    }
-    // mask out the key until release, so it doesn't register as a keystroke
-    Kaleidoscope.device().maskKey(key_addr);
-    return kaleidoscope::EventHandlerResult::EVENT_CONSUMED;
-  }
+  if(recording && !isInjected) onRecordingKeystroke(mapped_key, key_addr, key_state);
 
-  // If we reach this point, we know the currentState must be IDLE
-  if(mapped_key.getRaw() == MACROPLAY) {
+  if(mapped_key.getRaw() == playKey.getRaw()) {
     if(keyToggledOn(key_state)) {  // we only take action on ToggledOn events
       play_key_addr = key_addr;
       currentState = PICKING_SLOT_FOR_PLAY;
@@ -419,6 +793,87 @@ kaleidoscope::EventHandlerResult MacrosOnTheFly::onKeyswitchEvent(Key &mapped_ke
   return kaleidoscope::EventHandlerResult::OK;
 }
 
+void MacrosOnTheFly::onRecordingKeystroke(Key &mapped_key, KeyAddr key_addr, uint8_t key_state) {
+  // Any key other than (idle) MACROREC during recording is recorded.
+  // In particular, MACROPLAY is still recorded.  This means you can nest our macros,
+  //   i.e. you can playback an on-the-fly macro as part of another on-the-fly macro.
+  // This is a cool feature which we get for free with this ordering.
+  // We also don't record injected keys - see comments in onKeyswitchEvent()
+  recording = recordKeystroke(mapped_key, key_state);
+  if(!recording) {
+    // the Slot has been freed, so if it was playing, that has to stop now
+    for(uint8_t c = 0; c < PLAYBACK_CHANNELS; c++) {
+      for(uint8_t i = 0; i < channels[c].depth; i++) {
+        if(channels[c].frames[i].slot == recordingSlot) {
+          stopPlayback(c);
+          break;
+        }
+      }
+    }
+    if(colorEffects) LED_record_fail(key_addr.row(), key_addr.col());
+  }
+  // Keys typed during recording should also be handled normally (including keys
+  // controlling macro playback), so our callers carry on handling the key as
+  // normal afterwards.
+}
+
+kaleidoscope::EventHandlerResult MacrosOnTheFly::onPickingSlotForRec(Key &mapped_key, KeyAddr key_addr, uint8_t key_state) {
+  if(!keyToggledOn(key_state)) return kaleidoscope::EventHandlerResult::OK;  // we only take action on ToggledOn events
+  if(!modsAreSlots && isModifier(mapped_key)) {
+    // if this is a modifier, and we're not using modifiers as slots
+    //   themselves, then just let the modifier be handled normally -
+    //   it could be used to modify the slot-choice key
+    return kaleidoscope::EventHandlerResult::OK;
+  }
+  if(mapped_key.getRaw() == playKey.getRaw()) {
+    if(colorEffects) LED_record_fail(key_addr.row(), key_addr.col());  // Trying to record into the PLAY slot is error
+  } else {
+    mapped_key.setFlags(mapped_key.getFlags() | modifierFlagsFromReport());
+    recording = prepareForRecording(mapped_key);
+    if(recording) {
+      slot_key_addr = key_addr;
+    }
+    if(!recording && colorEffects) LED_record_fail(key_addr.row(), key_addr.col());
+  }
+  currentState = IDLE;
+  // mask out this key until it is released, so that we don't accidentally include it in the
+  //   recorded macro, or (if recording failed) it doesn't register as a keystroke
+  Kaleidoscope.device().maskKey(key_addr);
+  return kaleidoscope::EventHandlerResult::EVENT_CONSUMED;
+}
+
+kaleidoscope::EventHandlerResult MacrosOnTheFly::onPickingSlotForPlay(Key &mapped_key, KeyAddr key_addr, uint8_t key_state) {
+  if(!keyToggledOn(key_state)) return kaleidoscope::EventHandlerResult::OK;  // we only take action on ToggledOn events
+  if(!modsAreSlots && isModifier(mapped_key)) {
+    // if this is a modifier, and we're not using modifiers as slots
+    //   themselves, then just let the modifier be handled normally -
+    //   it could be used to modify the slot-choice key
+    return kaleidoscope::EventHandlerResult::OK;
+  }
+  mapped_key.setFlags(mapped_key.getFlags() | modifierFlagsFromReport());
+  // at this point, we have selected a slot and will play a macro
+  currentState = IDLE;
+  // MACROPLAY again means to replay the last macro played, which may have
+  //   been evicted since, like any other
+  const bool replay = mapped_key.getRaw() == playKey.getRaw();
+  const Key slotKey = replay ? lastPlayedKey : mapped_key;
+  int16_t index = -1;
+  if(slotKey != Key_NoKey) {
+    index = findSlot(slotKey);
+    if(index < 0) index = faultInSlot(slotKey);  // not in macroStorage; maybe it's in a bank
+  }
+  const bool success = index >= 0 && startPlayback(index);
+  if(success) lastPlayedKey = slotKey;
+  if(colorEffects) {
+    if(success) LED_play_success(key_addr.row(), key_addr.col());
+    else LED_play_fail(key_addr.row(), key_addr.col());
+  }
+  // mask out the key until release, so it doesn't register as a keystroke
+  Kaleidoscope.device().maskKey(key_addr);
+  return kaleidoscope::EventHandlerResult::EVENT_CONSUMED;
+}
+
+#if MACROSONTHEFLY_LEDS
 void MacrosOnTheFly::LED_record_fail(const uint8_t row, const uint8_t col) {
   flashOverride.flashAllLEDs(failColor);
 }
@@ -437,7 +892,26 @@ void MacrosOnTheFly::LED_play_fail(const uint8_t row, const uint8_t col) {
   flashOverride.flashSecondLED(row, col, emptyColor);
 }
 
+#endif
+
+kaleidoscope::EventHandlerResult MacrosOnTheFly::beforeReportingState() {
+  // The core releases all keys after every cycle, so keys the macro is
+  //   holding down need to be pressed again in each new one
+  if(isPlaybackActive()) {
+    playing = true;
+    pressHeldKeys();
+    playing = false;
+  }
+  // Play from here, rather than after the core has sent its report, so that
+  //   the report already holds the keys the user is pressing this cycle, and
+  //   the reports we send during playback keep them pressed
+  stepPlayback();
+  return kaleidoscope::EventHandlerResult::OK;
+}
+
 kaleidoscope::EventHandlerResult MacrosOnTheFly::afterEachCycle() {
+  stepWriteback();
+#if MACROSONTHEFLY_LEDS
   if(!colorEffects) return kaleidoscope::EventHandlerResult::OK;
   debug_print("MacrosOnTheFly: currentState ");
   switch(currentState) {
@@ -462,8 +936,10 @@ kaleidoscope::EventHandlerResult MacrosOnTheFly::afterEachCycle() {
       break;
   }
   return flashOverride.afterEachCycle();
+#else
+  return kaleidoscope::EventHandlerResult::OK;
+#endif
 }
 
 }
 
-kaleidoscope::MacrosOnTheFly MacrosOnTheFly;
@@ -20,7 +20,45 @@
 
 #include <Kaleidoscope.h>
 #include <Kaleidoscope-Ranges.h>
+#include <Kaleidoscope-EEPROM-Settings.h>
+
+/* Compile-time configuration
+ * By default, .modsAreSlots and .colorEffects can be changed at runtime.
+ *   Defining MACROSONTHEFLY_MODS_ARE_SLOTS or MACROSONTHEFLY_COLOR_EFFECTS
+ *   to 0 or 1 fixes that option at build time instead, so the checks for it
+ *   are resolved by the compiler.
+ * With MACROSONTHEFLY_COLOR_EFFECTS set to 0, the color properties and all of
+ *   the LED code (including FlashOverride) are left out of the build entirely.
+ * These have to be seen by this plugin's .cpp as well as the sketch, so set
+ *   them in the build flags (e.g. -DMACROSONTHEFLY_COLOR_EFFECTS=0) rather
+ *   than with a #define in the sketch.
+ * They change the layout of the class, so the class is declared in an inline
+ *   namespace named after them: a sketch built with different settings than
+ *   the plugin then fails to link, rather than quietly corrupting memory.
+ */
+#if defined(MACROSONTHEFLY_COLOR_EFFECTS) && !MACROSONTHEFLY_COLOR_EFFECTS
+#define MACROSONTHEFLY_LEDS 0
+#else
+#define MACROSONTHEFLY_LEDS 1
 #include "FlashOverride.h"
+#endif
+
+#if !defined(MACROSONTHEFLY_MODS_ARE_SLOTS)
+#define MACROSONTHEFLY_MODS_TAG r  // set at runtime
+#elif MACROSONTHEFLY_MODS_ARE_SLOTS
+#define MACROSONTHEFLY_MODS_TAG 1
+#else
+#define MACROSONTHEFLY_MODS_TAG 0
+#endif
+#if !defined(MACROSONTHEFLY_COLOR_EFFECTS)
+#define MACROSONTHEFLY_COLORS_TAG r
+#elif MACROSONTHEFLY_COLOR_EFFECTS
+#define MACROSONTHEFLY_COLORS_TAG 1
+#else
+#define MACROSONTHEFLY_COLORS_TAG 0
+#endif
+#define MACROSONTHEFLY_CONFIG_NS_(mods, colors) config_mods_##mods##_colors_##colors
+#define MACROSONTHEFLY_CONFIG_NS(mods, colors) MACROSONTHEFLY_CONFIG_NS_(mods, colors)
 
 #define MACROREC kaleidoscope::ranges::KALEIDOSCOPE_SAFE_START
 #define MACROPLAY kaleidoscope::ranges::KALEIDOSCOPE_SAFE_START + 1
@@ -28,46 +66,97 @@
 #define Key_MacroPlay (Key) {.raw = MACROPLAY}
 
 namespace kaleidoscope {
+inline namespace MACROSONTHEFLY_CONFIG_NS(MACROSONTHEFLY_MODS_TAG, MACROSONTHEFLY_COLORS_TAG) {
 
 class MacrosOnTheFly : public kaleidoscope::Plugin {
  public:
-  MacrosOnTheFly(void);
-
-  // basically everything else, public and private, has to be static so that
-  // it can be called/accessed in our eventHandlerHook and/or loopHook
-  static bool modsAreSlots;
-  static bool colorEffects;
-  static cRGB recordColor;
-  static cRGB slotColor;
-  static cRGB successColor;
-  static cRGB failColor;
-  static cRGB playColor;
-  static cRGB emptyColor;
+  /* storage: the memory to keep recorded macros in (see notes on storage
+   *   below).  This must stay valid for the lifetime of the plugin, must be
+   *   at least sizeof(Slot) + sizeof(Entry) bytes (or else nothing can be
+   *   recorded), and must be less than 32768 bytes.  On boards that need it
+   *   (ARM), it must be 2-byte aligned.
+   * recKey, playKey: the keys that start recording and playback.
+   * The global MacrosOnTheFly object uses DEFAULT_STORAGE_SIZE_IN_BYTES of
+   *   its own; sketches wanting a different size, or a different place, can
+   *   construct their own instead.  Each instance has its own macros, so
+   *   several can be active at once, as long as each has its own keys.
+   */
+  MacrosOnTheFly(byte *storage, uint16_t storageSize,
+                 Key recKey = Key_MacroRec, Key playKey = Key_MacroPlay);
+
+  static const uint16_t DEFAULT_STORAGE_SIZE_IN_BYTES = 300;
+
+#ifdef MACROSONTHEFLY_MODS_ARE_SLOTS
+  static constexpr bool modsAreSlots = MACROSONTHEFLY_MODS_ARE_SLOTS;
+#else
+  bool modsAreSlots;
+#endif
+#ifdef MACROSONTHEFLY_COLOR_EFFECTS
+  static constexpr bool colorEffects = MACROSONTHEFLY_COLOR_EFFECTS;
+#else
+  bool colorEffects;
+#endif
+#if MACROSONTHEFLY_LEDS
+  cRGB recordColor;
+  cRGB slotColor;
+  cRGB successColor;
+  cRGB failColor;
+  cRGB playColor;
+  cRGB emptyColor;
+#endif
+
+  /* Minimum time between HID reports sent during playback, in microseconds,
+   *   however quickly the host seems to take them.  Pacing (see below) can
+   *   only see a host that is slow to accept reports, not one (e.g. a KVM)
+   *   that accepts them quickly and then drops some; for those, set this a
+   *   little above the rate at which they pass reports on.  Default 0.
+   */
+  uint16_t minPlaybackReportInterval;
+
+  /* Keep recorded macros in 'numBanks' banks of persistent storage (EEPROM).
+   * Call this from the sketch's setup(), after Kaleidoscope.setup(), and
+   *   include EEPROMSettings in KALEIDOSCOPE_INIT_PLUGINS.
+   * Once enabled, macroStorage only holds a working set of recently used
+   *   slots; other slots are loaded from their bank the first time they are
+   *   played.  See the notes on banks below.
+   */
+  void setupPersistence(uint8_t numBanks);
+
+  /* Current minimum time between HID reports sent during playback, in
+   *   microseconds.  0 means playback runs as fast as the loop allows.
+   * This adapts automatically (see the notes on pacing below), but never
+   *   goes below minPlaybackReportInterval.
+   */
+  uint16_t playbackReportInterval() const {
+    return reportInterval > minPlaybackReportInterval ? reportInterval : minPlaybackReportInterval;
+  }
 
   kaleidoscope::EventHandlerResult onKeyswitchEvent(Key &mapped_key, KeyAddr key_addr, uint8_t key_state);
+  kaleidoscope::EventHandlerResult beforeReportingState();
   kaleidoscope::EventHandlerResult afterEachCycle();
 
  private:
-  /* STORAGE_SIZE_IN_BYTES: Number of bytes of RAM to reserve for macro storage.
+  /* macroStorage: the actual storage for macros, supplied by the sketch;
+   *   storageSize bytes long.
    * Each slot used requires one Slot object from this, and each keystroke that
    *   is part of a macro requires one Entry object.
-   * Currently this means 6 bytes per slot used, plus 3 bytes per keystroke
+   * Currently this means 9 bytes per slot used, plus 3 bytes per keystroke
    *   stored across all recorded macros.
-   * Obviously STORAGE_SIZE_IN_BYTES could be adjusted higher, at the cost of
-   *   this plugin using more space in the firmware image.
-   * To adjust it higher than sizeof(Slot) + 3*255 (so currently 771 bytes),
-   *   you'll need to increase numAllocatedKeystrokes to a uint16_t in the Slot
-   *   object, and either also numUsedKeystrokes to uint16_t, or insert extra
-   *   logic to limit numUsedKeystrokes to 255 even when numAllocatedKeystrokes
-   *   is higher.  (Some local variables in MacrosOnTheFly.cpp may also need to
-   *   be increased to uint16_t.)
-   * STORAGE_SIZE_IN_BYTES could also be adjusted lower to save space, at the
-   *   cost of more likely the user hits the limit.
-   */
-  static const uint16_t STORAGE_SIZE_IN_BYTES = 300;
-
-  /* the actual storage for macros */
-  static byte macroStorage[STORAGE_SIZE_IN_BYTES];
+   * A larger storage area lets the user record more, at the cost of RAM.
+   *   Whatever the size, a single macro is limited to 255 keystrokes.
+   * With persistence enabled (see setupPersistence()), this is only the size
+   *   of the working set; slots that have been written back to a bank can be
+   *   evicted to make room, and total capacity is limited by the number of
+   *   banks instead.
+   */
+  byte *macroStorage;
+  uint16_t storageSize;
+
+  /* the keys this instance responds to (Key_MacroRec and Key_MacroPlay,
+   *   unless the sketch gave others)
+   */
+  Key recKey;
+  Key playKey;
 
 #define UP WAS_PRESSED
 #define DOWN IS_PRESSED
@@ -84,8 +173,10 @@ class MacrosOnTheFly : public kaleidoscope::Plugin {
   /* Metadata / header for each macro stored
    * A subtle assumption made by the code is that sizeof(Slot) >= sizeof(Entry)
    *   which should always be the case, but I thought I'd document it
+   * The allocator also counts space in whole Entries, so sizeof(Slot) must be
+   *   a multiple of sizeof(Entry): see Slot below.
    */
-  typedef struct Slot_ {
+  typedef struct SlotHeader_ {
     /* which key this Slot is associated with, or Key_NoKey if not associated
      *   with any key.  In that case, numUsedKeystrokes must be 0.
      * This is a "mapped" key, not a physical key - see issue #1.
@@ -94,19 +185,38 @@ class MacrosOnTheFly : public kaleidoscope::Plugin {
 
     /* Index in macroStorage of the previous Slot.
      * For the first Slot in macroStorage, this will be set to a value higher
-     *   than STORAGE_SIZE_IN_BYTES.
+     *   than storageSize.
      */
     uint16_t previousSlot;
 
-    /* Allocated size of the keystrokes[] array.  Assume <= 255 */
-    uint8_t numAllocatedKeystrokes;
+    /* Index of the persistent bank holding a copy of this Slot, or NO_BANK if
+     *   there is none (persistence disabled, macro too long for a bank, or not
+     *   yet written back).
+     * Only Slots with a bank are 'clean' and can be evicted from macroStorage.
+     */
+    uint8_t bank;
+
+    /* value of useClock when this Slot was last created or played; used to
+     *   pick the least-recently-used Slot when evicting
+     */
+    uint8_t lastUsed;
+
+    /* Allocated size of the keystrokes[] array */
+    uint16_t numAllocatedKeystrokes;
 
     /* Number of entries in keystrokes[] that this is actually using (can be 0)
-     * Must not exceed numAllocatedKeystrokes. If this is less than
+     * Must not exceed numAllocatedKeystrokes, nor 255. If this is less than
      *   numAllocatedKeystrokes, that indicates there is extra unused space
      *   available between this Slot and the next
      */
     uint8_t numUsedKeystrokes;
+  } SlotHeader;
+
+  typedef struct Slot_ : SlotHeader {
+    /* Pads the Slot out to a whole number of Entries.  Empty where Entry is
+     *   3 bytes (AVR), but not where it is padded to 4 (ARM, virtual).
+     */
+    byte padding[(sizeof(Entry) - sizeof(SlotHeader) % sizeof(Entry)) % sizeof(Entry)];
 
     /* Array of stored keystrokes. Size of this array is equal at all times to
      *   numAllocatedKeystrokes, but only the first numUsedKeystrokes entries
@@ -114,50 +224,70 @@ class MacrosOnTheFly : public kaleidoscope::Plugin {
      */
     Entry keystrokes[0];
   } Slot;
+  static_assert(sizeof(Slot) % sizeof(Entry) == 0, "Slot must be a whole number of Entries");
 
   typedef enum State_ {
     IDLE,
-    PICKING_SLOT_FOR_REC,   // Key_MacroRec has been pressed, the next key chooses a slot
-    PICKING_SLOT_FOR_PLAY,  // Key_MacroPlay has been pressed, the next key chooses a slot
+    PICKING_SLOT_FOR_REC,   // recKey has been pressed, the next key chooses a slot
+    PICKING_SLOT_FOR_PLAY,  // playKey has been pressed, the next key chooses a slot
   } State;
-  static State currentState;
+  State currentState;
+
+  /* onKeyswitchEvent() handles our two "picking" states separately, and
+   *   dispatches toggle events for the current state to one of these
+   */
+  kaleidoscope::EventHandlerResult onIdle(Key &mapped_key, KeyAddr key_addr, uint8_t key_state, bool isInjected);
+  kaleidoscope::EventHandlerResult onPickingSlotForRec(Key &mapped_key, KeyAddr key_addr, uint8_t key_state);
+  kaleidoscope::EventHandlerResult onPickingSlotForPlay(Key &mapped_key, KeyAddr key_addr, uint8_t key_state);
+  /* record a keystroke the user typed while recording */
+  void onRecordingKeystroke(Key &mapped_key, KeyAddr key_addr, uint8_t key_state);
 
   /* are we currently recording a macro */
-  static bool recording;
+  bool recording;
 
-  /* are we currently playing a macro */
-  static bool playing;
+  /* are we currently injecting keystrokes from macro playback
+   * This is only TRUE for the duration of stepChannel() and similar; use
+   *   isPlaybackActive() to tell whether a macro is in progress
+   */
+  bool playing;
+
+  /* if playing==TRUE, the index in channels[] whose keystrokes we're injecting */
+  uint8_t activeChannel;
 
   /* if recording==TRUE, the index in macroStorage of the Slot we're recording
    *   into
    * if recording==TRUE, recordingSlot is guaranteed to be a valid Slot with
    *   at least one allocated keystroke
    */
-  static uint16_t recordingSlot;
+  uint16_t recordingSlot;
 
   /* get the index in macroStorage of the Slot currently associated with
    *   the given key; or if no such Slot, then -1
    */
-  static int16_t findSlot(Key key);
+  int16_t findSlot(Key key);
 
   /* allocate a new Slot associated with the given key
    * One invariant maintained by the codebase is that any given key only ever
    *   has at most one Slot associated with it.  This function will not
    *   check/enforce that, so it is your responsibility to ensure there is not
    *   already a slot for the given key before calling this
+   * If there are fewer than 'wantedKeystrokes' keystrokes of free space, clean
+   *   Slots are evicted (least recently used first) until there are, or until
+   *   nothing more can be evicted.
    * The newly allocated Slot is guaranteed to have:
    *   -> key set to the key you pass in
-   *   -> at least one allocated keystroke
+   *   -> at least one allocated keystroke (but possibly fewer than
+   *      'wantedKeystrokes')
    *   -> numUsedKeystrokes set to 0
    * Returns the index in macroStorage of the new slot; or if no room to create
    *   a new Slot, then -1
    */
-  static int16_t newSlot(Key key);
+  int16_t newSlot(Key key, uint8_t wantedKeystrokes = 1);
 
   /* get the index in macroStorage of the Slot with the largest 'free' portion
    *   as determined by getFreeSpace()
    */
-  static uint16_t getSlotWithMostFreeSpace();
+  uint16_t getSlotWithMostFreeSpace();
 
   /* index: the index in macroStorage of any Slot
    * returns the amount of free space in that slot, in bytes
@@ -165,43 +295,206 @@ class MacrosOnTheFly : public kaleidoscope::Plugin {
    *   with the complication that for any Slot not associated with a key (i.e.
    *   key == Key_NoKey), the Slot struct itself also counts as 'free' space
    */
-  static uint16_t getFreeSpace(uint16_t index);
+  uint16_t getFreeSpace(uint16_t index);
 
   /* prepare for recording into the slot associated with the given key
    * returns FALSE if there is not enough free space, TRUE otherwise
    */
-  static bool prepareForRecording(Key key);
+  bool prepareForRecording(Key key);
 
   /* Record a keystroke into 'recordingSlot'.
+   * key_state must be a toggle event (toggled on or off); onKeyswitchEvent()
+   *   has already filtered out everything else.
    * returns FALSE if there was not enough room, TRUE otherwise
    */
-  static bool recordKeystroke(Key key, uint8_t key_state);
+  bool recordKeystroke(Key key, uint8_t key_state);
+
+  /* make room for at least one more keystroke in the full 'recordingSlot',
+   *   by taking over the next Slot if it is clean, or else by evicting clean
+   *   Slots and moving the recording to wherever there is room (this updates
+   *   'recordingSlot')
+   * returns FALSE if there was no way to make room, TRUE otherwise
+   */
+  bool growRecordingSlot();
+
+  /* Playback
+   * Macros are played back a keystroke at a time from
+   *   beforeReportingState(), so that long macros don't stall the scan loop,
+   *   and so that we can pace the reports we send.  Keys the user is holding
+   *   are already in the report by then, and stay in it.
+   * Up to PLAYBACK_CHANNELS macros can play at once, each in its own channel
+   *   (see PlaybackChannel below).  Busy channels take turns, one keystroke
+   *   each, and the turns carry on from one cycle to the next.
+   * When a macro plays another (nested MACROPLAY), the inner one is pushed
+   *   on to its channel's frames, and played to the end before the outer one
+   *   continues, just as if it had been played inline.
+   */
+  static const uint8_t PLAYBACK_CHANNELS = 3;
+  static const uint8_t MAX_PLAYBACK_DEPTH = 4;
+  typedef struct PlaybackFrame_ {
+    uint16_t slot;  // index in macroStorage of the Slot being played
+    uint8_t nextKeystroke;  // index in the Slot's keystrokes[] of the next one to play
+    bool pressDone;  // if the next keystroke is a TAP, whether we already sent its press
+  } PlaybackFrame;
 
   /* index: the index in macroStorage of the Slot to play
-   * returns FALSE if the slot was empty, TRUE otherwise
+   * If we're in the middle of injecting keystrokes from another macro, this
+   *   plays the Slot nested inside it, in the same channel; otherwise it
+   *   starts on a free channel.
+   * returns FALSE if the slot was empty, if there is no free channel, or if
+   *   the nesting is too deep; TRUE otherwise
+   */
+  bool startPlayback(uint16_t index);
+
+  /* abandon the playback in the given channel, releasing any keys it holds */
+  void stopPlayback(uint8_t channel);
+
+  /* report a channel's accounting once its macro is done (virtual build only;
+   *   the test harness compares these against its golden traces)
    */
-  static bool play(uint16_t index);
+#ifdef ARDUINO_VIRTUAL
+  void printPlaybackStats(uint8_t channel);
+#else
+  void printPlaybackStats(uint8_t) {}
+#endif
+
+  /* whether any channel is playing a macro */
+  bool isPlaybackActive();
 
-  /* the index in macroStorage of the Slot that was most recently played.
-   * This is guaranteed to point to a valid Slot at all times
+  /* whether the given Slot is being played (in any channel, at any depth) */
+  bool slotIsPlaying(uint16_t index);
+
+  /* play keystrokes for this cycle, as many as pacing allows */
+  void stepPlayback();
+
+  /* play the next keystroke in the given channel; or if that leaves us
+   *   picking a slot, keystrokes up to and including the choice
+   * returns the number of reports sent
+   */
+  uint8_t stepChannel(uint8_t channel);
+
+  /* press the keys held by every channel (see pressPressedKeys()) */
+  void pressHeldKeys();
+
+  /* Pacing
+   * Some hosts (and KVMs, remote desktop clients, etc) drop reports if they
+   *   arrive too fast.  We can't see a dropped report, but we can see the
+   *   host being slow to accept one: sendReport() then blocks waiting for the
+   *   USB endpoint.  When that takes longer than STALL_THRESHOLD_US we back
+   *   off, doubling reportInterval; after RAMP_UP_AFTER reports in a row
+   *   are accepted quickly, we halve it again.  Hosts that drop reports
+   *   without ever being slow to accept one need minPlaybackReportInterval.
+   * MAX_REPORTS_PER_CYCLE bounds the work done per cycle even at full speed.
    */
-  static uint16_t lastPlayedSlot;
+  static const uint16_t STALL_THRESHOLD_US = 2000;
+  static const uint16_t BACKOFF_STEP_US = 1000;
+  static const uint16_t MAX_REPORT_INTERVAL_US = 32000;
+  static const uint8_t RAMP_UP_AFTER = 32;
+  static const uint8_t MAX_REPORTS_PER_CYCLE = 8;
+  uint16_t reportInterval;
+  uint32_t lastReportTime;  // micros() after the last playback report
+  uint8_t fastReports;  // number of reports in a row accepted quickly
+
+  /* send a report during playback, and adjust pacing accordingly */
+  void sendPlaybackReport();
+
+  /* the key of the macro that was most recently played (Key_NoKey if none
+   *   yet).  Its Slot isn't kept in macroStorage for the sake of replaying
+   *   it; it is found, or faulted back in, like any other.
+   */
+  Key lastPlayedKey;
 
   /* index: the index in macroStorage of the Slot to free */
-  static void free(uint16_t index);
+  void free(uint16_t index);
+
+  /* Persistent banks.
+   * Each bank is a fixed-size record in persistent storage holding one macro:
+   *   the key (2 bytes), numUsedKeystrokes (1 byte), then BANK_KEYSTROKES
+   *   entries of 3 bytes each (key, then state).  A bank whose
+   *   numUsedKeystrokes is 0 or greater than BANK_KEYSTROKES (e.g. erased
+   *   EEPROM) is empty.
+   * Macros longer than BANK_KEYSTROKES are never written back, and only live
+   *   in macroStorage until power is lost.
+   * EEPROM writes are slow, so a finished recording is written back one byte
+   *   per cycle from afterEachCycle() rather than all at once.  The bank is
+   *   marked empty while this is in progress, and only marked valid again by
+   *   the very last write.
+   */
+  static const uint8_t BANK_KEYSTROKES = 32;
+  static const uint8_t BANK_HEADER_SIZE = 3;
+  static const uint8_t BANK_ENTRY_SIZE = 3;
+  static const uint16_t BANK_SIZE = BANK_HEADER_SIZE + BANK_ENTRY_SIZE * BANK_KEYSTROKES;
+  static const uint8_t NO_BANK = 0xff;
+
+  uint8_t numBanks;  // 0 if persistence is disabled
+  uint16_t banksBase;  // start of our slice of persistent storage
+  uint8_t useClock;  // incremented every time a Slot is created or played
+
+  /* Slot being written back, or -1 if none; and where we are in doing so */
+  int16_t writebackSlot;
+  uint8_t writebackBank;
+  uint16_t writebackStep;
+
+  /* whether there may be finished recordings still to write back
+   * Rather than keeping a queue, stepWriteback() looks for the next one (any
+   *   Slot with keystrokes but no bank) when the previous one is done.
+   */
+  bool writebackPending;
 
-  static void LED_record_inprogress();
-  static void LED_record_slotindicator(uint8_t row, uint8_t col);
-  static void LED_record_fail(uint8_t row, uint8_t col);
-  static void LED_record_success(uint8_t row, uint8_t col);
-  static void LED_play_success(uint8_t row, uint8_t col);
-  static void LED_play_fail(uint8_t row, uint8_t col);
+  /* get the bank currently holding a macro for the given key, or -1 if none */
+  int16_t findBank(Key key);
+
+  /* get the first empty bank, or -1 if all are in use */
+  int16_t findEmptyBank();
+
+  /* load the macro for the given key from its bank into a new Slot
+   * returns the index in macroStorage of the new Slot; or -1 if there is no
+   *   bank for this key or not enough room for it
+   */
+  int16_t faultInSlot(Key key);
 
-  // keep track of where Key_MacroRec, Key_MacroPlay, and recordingSlot are
+  /* whether the Slot at the given index could be evicted (ignoring playback) */
+  bool isEvictable(uint16_t index);
+
+  /* free the least-recently-used clean Slot
+   * returns FALSE if there was nothing which could be evicted
+   */
+  bool evictSlot();
+
+  /* mark any bank for the given key as empty */
+  void eraseBank(Key key);
+
+  /* find the next finished recording that can be persisted, and start
+   *   writing it back to an empty bank.  Clears writebackPending if there is
+   *   nothing (more) to write back, or no empty bank for it.
+   */
+  void startNextWriteback();
+
+  /* do the next single-byte write of an in-progress writeback, if any;
+   *   starting the next pending one when the previous one is done
+   */
+  void stepWriteback();
+
+#if MACROSONTHEFLY_LEDS
+  void LED_record_inprogress();
+  void LED_record_slotindicator(uint8_t row, uint8_t col);
+  void LED_record_fail(uint8_t row, uint8_t col);
+  void LED_record_success(uint8_t row, uint8_t col);
+  void LED_play_success(uint8_t row, uint8_t col);
+  void LED_play_fail(uint8_t row, uint8_t col);
+#else
+  // only ever called behind 'if(colorEffects)', which is constant false here
+  void LED_record_fail(uint8_t, uint8_t) {}
+  void LED_record_success(uint8_t, uint8_t) {}
+  void LED_play_success(uint8_t, uint8_t) {}
+  void LED_play_fail(uint8_t, uint8_t) {}
+#endif
+
+  // keep track of where recKey, playKey, and recordingSlot are
   //   for LED purposes
-  static KeyAddr play_key_addr;
-  static KeyAddr rec_key_addr;
-  static KeyAddr slot_key_addr;
+  KeyAddr play_key_addr;
+  KeyAddr rec_key_addr;
+  KeyAddr slot_key_addr;
 
 
   // Maximum number of simultaneously held keys during a dynamic macro.
@@ -209,17 +502,54 @@ class MacrosOnTheFly : public kaleidoscope::Plugin {
   //   you just can't hold any more (they will be instantly released)
   // This means that inside dynamic macros, we only support 16-key rollover
   //   (or whatever the value of MAX_SIMULTANEOUS_HELD_KEYS), not true NKRO.
-  // Increasing this number by N increases local variables' RAM usage by
-  //   2*N*(playback recursion depth)
+  // All levels of nested playback in a channel share its one set of held
+  //   keys, but each key remembers the depth that pressed it, so that a
+  //   nested macro's keys are released when it ends.
+  // Increasing this number by N increases RAM usage by 3*N bytes per
+  //   playback channel.
   static const uint8_t MAX_SIMULTANEOUS_HELD_KEYS = 16;
-  static void addToPressedKeys(Key key, Key* pressedKeys);
-  static void removeFromPressedKeys(Key key, Key* pressedKeys);
-  static void pressPressedKeys(Key* pressedKeys);
-  static void clearPressedKeys(Key* pressedKeys);
 
-  static FlashOverride flashOverride;
+#ifdef ARDUINO_VIRTUAL
+  /* Playback accounting, for the virtual (host) build only.  It covers a
+   *   whole top-level macro, nested macros included, and is printed along
+   *   with the HID reports when the macro finishes, so that test scripts can
+   *   check both what playback sent and how much work it took.
+   */
+  typedef struct PlaybackStats_ {
+    uint16_t reports;  // HID reports sent
+    uint16_t events;  // keyswitch events injected, including held-key re-presses
+    uint16_t cycles;  // scan cycles the macro was playing for
+  } PlaybackStats;
+#endif
+
+  typedef struct PlaybackChannel_ {
+    PlaybackFrame frames[MAX_PLAYBACK_DEPTH];
+    uint8_t depth;  // number of frames in use; 0 if this channel is free
+    Key pressedKeys[MAX_SIMULTANEOUS_HELD_KEYS];  // keys held by this channel's macro
+    uint8_t pressedDepths[MAX_SIMULTANEOUS_HELD_KEYS];  // channel depth when each key was pressed
+#ifdef ARDUINO_VIRTUAL
+    PlaybackStats stats;
+#endif
+  } PlaybackChannel;
+  PlaybackChannel channels[PLAYBACK_CHANNELS];
+  uint8_t nextChannel;  // the channel whose turn is next
+
+  static void addToPressedKeys(Key key, PlaybackChannel& channel);  // pressed by the channel's current frame
+  static void removeFromPressedKeys(Key key, PlaybackChannel& channel);
+  static void removePressedKeyAt(uint8_t i, PlaybackChannel& channel);
+  /* release the keys still held by a frame that has just been popped; returns
+   *   whether there were any
+   */
+  static bool releaseFrameKeys(PlaybackChannel& channel);
+  static uint8_t pressPressedKeys(PlaybackChannel& channel);  // returns the number of keys pressed
+  static void clearPressedKeys(PlaybackChannel& channel);
+
+#if MACROSONTHEFLY_LEDS
+  FlashOverride flashOverride;
+#endif
 };
 
+}
 }
 
 extern kaleidoscope::MacrosOnTheFly MacrosOnTheFly;
@@ -0,0 +1,68 @@
+/* -*- mode: c++ -*-
+ * Kaleidoscope-MacrosOnTheFly -- Record and play back macros on-the-fly.
+ * Copyright (C) 2017  Craig Disselkoen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Per-event microbenchmark for onKeyswitchEvent()
+ * The core calls onKeyswitchEvent() for every key on every scan cycle, and
+ *   almost all of those calls are for keys that are idle or just being held.
+ *   This times the plugin's handling of each kind of event on the host
+ *   (`make bench`).  Host timings don't carry over to the keyboard's MCU as
+ *   such, but the relative cost of the cases does.
+ */
+
+#include "harness.h"
+
+#include <chrono>
+
+using namespace harness;
+
+static const uint32_t ITERATIONS = 10000000;
+
+// Deliver 'key' with each of 'states' in turn, ITERATIONS times in all
+static void bench(const char *name, Key key, const uint8_t *states, uint8_t numStates) {
+  kaleidoscope::MacrosOnTheFly &p = plugin();
+  const KeyAddr addr = {0, 0};
+  uint32_t consumed = 0;
+  const auto start = std::chrono::steady_clock::now();
+  for(uint32_t i = 0; i < ITERATIONS; i++) {
+    Key mapped = key;
+    if(p.onKeyswitchEvent(mapped, addr, states[i % numStates]) != kaleidoscope::EventHandlerResult::OK)
+      consumed++;
+  }
+  const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+  printf("%-32s %6.2f ns/event  (%u of %u consumed)\n", name, elapsed.count() / ITERATIONS, consumed, ITERATIONS);
+}
+
+int main() {
+  static const uint8_t idle[] = {0};
+  static const uint8_t held[] = {IS_PRESSED | WAS_PRESSED};
+  static const uint8_t toggles[] = {IS_PRESSED, WAS_PRESSED};
+
+  reset();
+  bench("idle key", Key_A, idle, 1);
+  bench("held key", Key_A, held, 1);
+  bench("held Key_MacroPlay", Key_MacroPlay, held, 1);
+  bench("key pressed and released", Key_A, toggles, 2);
+
+  // while recording, held keys mustn't cost any more (toggles would fill
+  //   the storage, so aren't timed)
+  tap(Key_MacroRec);
+  tap(Key_Q);
+  bench("idle key, recording", Key_A, idle, 1);
+  bench("held key, recording", Key_A, held, 1);
+  return 0;
+}
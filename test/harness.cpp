@@ -0,0 +1,394 @@
+/* -*- mode: c++ -*-
+ * Kaleidoscope-MacrosOnTheFly -- Record and play back macros on-the-fly.
+ * Copyright (C) 2017  Craig Disselkoen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "harness.h"
+
+#include <Kaleidoscope-LEDControl.h>  // LEDControl is defined here even if the plugin has no LEDs
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <set>
+#include <string>
+#include <vector>
+
+// The stand-ins' globals and implementations
+
+kaleidoscope::Runtime Kaleidoscope;
+EEPROMSettings_ EEPROMSettings;
+LEDControl_ LEDControl;
+
+namespace {
+
+kaleidoscope::MacrosOnTheFly *current;
+uint16_t currentStorageSize;
+uint8_t currentBanks;
+alignas(4) byte macroStorage[4096];
+alignas(kaleidoscope::MacrosOnTheFly) byte pluginMemory[sizeof(kaleidoscope::MacrosOnTheFly)];
+
+kaleidoscope::MacrosOnTheFly *second;  // see addInstance()
+alignas(4) byte secondStorage[4096];
+alignas(kaleidoscope::MacrosOnTheFly) byte secondMemory[sizeof(kaleidoscope::MacrosOnTheFly)];
+
+uint8_t eeprom[4096];
+uint16_t nextSlice;
+
+uint32_t clock_us;
+uint32_t pollInterval;  // see setPollInterval()
+uint32_t pollTimeout;
+uint32_t nextPoll;  // when the host next collects the report in the endpoint, if any
+bool pending;  // whether the endpoint holds a report the host hasn't collected yet
+std::set<uint8_t> pendingReport;
+std::set<uint8_t> hostReport;  // the last report the host collected
+std::string typed;  // see takeTyped()
+
+std::set<uint8_t> report;  // keycodes in the report being built
+std::set<uint8_t> lastReport;  // keycodes in the last report sent
+uint16_t quietCycles;  // cycles since a report last changed
+
+struct PhysicalKey {
+  Key key;
+  bool pressed;
+  bool wasPressed;
+  bool masked;
+};
+std::vector<PhysicalKey> keys;  // every key that's been pressed, in order
+
+void start(bool wipeEeprom) {
+  if(current) current->~MacrosOnTheFly();
+  if(second) second->~MacrosOnTheFly();
+  second = nullptr;
+  if(wipeEeprom) memset(eeprom, 0xff, sizeof(eeprom));
+  memset(macroStorage, 0xa5, sizeof(macroStorage));  // RAM doesn't start out clean
+  nextSlice = 0;
+  report.clear();
+  lastReport.clear();
+  keys.clear();
+  pollInterval = 0;
+  pending = false;
+  hostReport.clear();
+  typed.clear();
+  current = new(pluginMemory) kaleidoscope::MacrosOnTheFly(macroStorage, currentStorageSize);
+#ifndef MACROSONTHEFLY_COLOR_EFFECTS
+  current->colorEffects = false;
+#endif
+  if(currentBanks) current->setupPersistence(currentBanks);
+}
+
+PhysicalKey &physicalKey(Key key, KeyAddr *addr) {
+  for(size_t i = 0; i < keys.size(); i++) {
+    if(keys[i].key == key) {
+      if(addr) *addr = KeyAddr{uint8_t(i / 16), uint8_t(i % 16)};
+      return keys[i];
+    }
+  }
+  keys.push_back(PhysicalKey{key, false, false, false});
+  return physicalKey(key, addr);
+}
+
+// The keycodes a key puts in the report: its own, and those of its modifier flags
+std::vector<uint8_t> keycodes(Key key) {
+  std::vector<uint8_t> codes;
+  if(key.getKeyCode()) codes.push_back(key.getKeyCode());
+  const uint8_t flags = key.getFlags();
+  if(flags & SYNTHETIC) return codes;
+  if(flags & CTRL_HELD) codes.push_back(Key_LeftControl.getKeyCode());
+  if(flags & LALT_HELD) codes.push_back(Key_LeftAlt.getKeyCode());
+  if(flags & RALT_HELD) codes.push_back(Key_RightAlt.getKeyCode());
+  if(flags & SHIFT_HELD) codes.push_back(Key_LeftShift.getKeyCode());
+  if(flags & GUI_HELD) codes.push_back(Key_LeftGui.getKeyCode());
+  return codes;
+}
+
+void addToReport(Key key) {
+  for(uint8_t keycode : keycodes(key)) report.insert(keycode);
+}
+
+void printReport(const char *what, const std::set<uint8_t> &keycodes);
+
+// The host gets a report: note the letters newly pressed in it
+void deliver(const std::set<uint8_t> &keycodes) {
+  for(uint8_t keycode : keycodes) {
+    if(keycode >= Key_A.getKeyCode() && keycode <= Key_Z.getKeyCode() && !hostReport.count(keycode))
+      typed += char('a' + keycode - Key_A.getKeyCode());
+  }
+  hostReport = keycodes;
+}
+
+// The host collects the report in the endpoint (if any) at each of its polls
+//   up to now
+void poll() {
+  if(!pollInterval) return;
+  while(nextPoll <= clock_us) {
+    if(pending) deliver(pendingReport);
+    pending = false;
+    nextPoll += pollInterval;
+  }
+}
+
+const char *keyName(uint8_t keycode) {
+  static const char *modifiers[] = {"LCtrl", "LShift", "LAlt", "LGui", "RCtrl", "RShift", "RAlt", "RGui"};
+  static char name[8];
+  if(keycode >= Key_A.getKeyCode() && keycode <= Key_Z.getKeyCode()) {
+    name[0] = 'A' + keycode - Key_A.getKeyCode();
+    name[1] = '\0';
+    return name;
+  }
+  if(keycode >= Key_LeftControl.getKeyCode() && keycode <= Key_RightGui.getKeyCode())
+    return modifiers[keycode - Key_LeftControl.getKeyCode()];
+  snprintf(name, sizeof(name), "0x%02x", keycode);
+  return name;
+}
+
+void printReport(const char *what, const std::set<uint8_t> &keycodes) {
+  printf("%s [", what);
+  const char *separator = "";
+  for(uint8_t keycode : keycodes) {
+    printf("%s%s", separator, keyName(keycode));
+    separator = " ";
+  }
+  printf("]\n");
+}
+
+}
+
+void handleKeyswitchEvent(Key mappedKey, KeyAddr key_addr, uint8_t keyState) {
+  if(current->onKeyswitchEvent(mappedKey, key_addr, keyState) != kaleidoscope::EventHandlerResult::OK)
+    return;
+  if(second && second->onKeyswitchEvent(mappedKey, key_addr, keyState) != kaleidoscope::EventHandlerResult::OK)
+    return;
+  if(keyIsPressed(keyState)) addToReport(mappedKey);
+}
+
+unsigned long micros() {
+  return clock_us;
+}
+
+namespace kaleidoscope {
+
+namespace hid {
+Keyboard &HID::keyboard() {
+  static Keyboard keyboard;
+  return keyboard;
+}
+
+void Keyboard::sendReport() {
+  if(report != lastReport) {
+    printReport("report", report);
+    quietCycles = 0;
+    if(pollInterval) {
+      poll();
+      if(pending) {
+        // wait for the host to collect the previous report; but after
+        //   pollTimeout, give up and overwrite it
+        if(nextPoll - clock_us <= pollTimeout) {
+          clock_us = nextPoll;
+          poll();
+        } else {
+          clock_us += pollTimeout;
+          printReport("lost", pendingReport);
+        }
+      }
+      pendingReport = report;
+      pending = true;
+    } else {
+      clock_us += harness::REPORT_US;
+      deliver(report);
+    }
+  }
+  lastReport = report;
+}
+
+void Keyboard::releaseAllKeys() {
+  report.clear();
+}
+
+void Keyboard::releaseKey(Key key) {
+  for(uint8_t keycode : keycodes(key)) report.erase(keycode);
+}
+
+bool Keyboard::wasModifierKeyActive(Key key) {
+  return lastReport.count(key.getKeyCode());
+}
+}
+
+hid::HID &Runtime::hid() {
+  static hid::HID hid;
+  return hid;
+}
+
+Device &Runtime::device() {
+  static Device device;
+  return device;
+}
+
+Storage &Runtime::storage() {
+  static Storage storage;
+  return storage;
+}
+
+void Device::maskKey(KeyAddr key_addr) {
+  const size_t i = key_addr.row() * 16 + key_addr.col();
+  if(i < keys.size()) keys[i].masked = true;
+}
+
+uint8_t Storage::read(int offset) {
+  return eeprom[offset];
+}
+
+void Storage::update(int offset, uint8_t value) {
+  eeprom[offset] = value;
+}
+
+void Storage::commit() {}
+
+}
+
+uint16_t EEPROMSettings_::requestSlice(uint16_t size) {
+  const uint16_t slice = nextSlice;
+  nextSlice += size;
+  if(nextSlice > sizeof(eeprom)) {
+    printf("harness: out of EEPROM\n");
+    exit(1);
+  }
+  return slice;
+}
+
+// The harness itself
+
+namespace harness {
+
+void reset(uint16_t storageSize, uint8_t banks) {
+  currentStorageSize = storageSize;
+  currentBanks = banks;
+  start(true);
+}
+
+void powerCycle() {
+  start(false);
+}
+
+kaleidoscope::MacrosOnTheFly &plugin() {
+  return *current;
+}
+
+kaleidoscope::MacrosOnTheFly &addInstance(uint16_t storageSize, Key recKey, Key playKey) {
+  if(second) second->~MacrosOnTheFly();
+  memset(secondStorage, 0xa5, sizeof(secondStorage));
+  second = new(secondMemory) kaleidoscope::MacrosOnTheFly(secondStorage, storageSize, recKey, playKey);
+#ifndef MACROSONTHEFLY_COLOR_EFFECTS
+  second->colorEffects = false;
+#endif
+  return *second;
+}
+
+void press(Key key) {
+  physicalKey(key, nullptr).pressed = true;
+}
+
+void release(Key key) {
+  physicalKey(key, nullptr).pressed = false;
+}
+
+void cycle(uint16_t count) {
+  while(count--) {
+    for(size_t i = 0; i < keys.size(); i++) {
+      PhysicalKey &k = keys[i];
+      const uint8_t state = (k.pressed ? IS_PRESSED : 0) | (k.wasPressed ? WAS_PRESSED : 0);
+      k.wasPressed = k.pressed;
+      if(!state) continue;
+      if(k.masked) {
+        if(!k.pressed) k.masked = false;
+        continue;
+      }
+      handleKeyswitchEvent(k.key, KeyAddr{uint8_t(i / 16), uint8_t(i % 16)}, state);
+    }
+    current->beforeReportingState();
+    if(second) second->beforeReportingState();
+    Kaleidoscope.hid().keyboard().sendReport();
+    Kaleidoscope.hid().keyboard().releaseAllKeys();
+    current->afterEachCycle();
+    if(second) second->afterEachCycle();
+    clock_us += CYCLE_US;
+    poll();
+    quietCycles++;
+  }
+}
+
+void settle() {
+  quietCycles = 0;
+  for(uint16_t i = 0; i < 10000 && quietCycles < 50; i++) cycle();
+}
+
+Key letter(char c) {
+  return Key{uint16_t(Key_A.getRaw() + c - 'a')};
+}
+
+void tap(Key key) {
+  press(key);
+  cycle();
+  release(key);
+  cycle();
+}
+
+void type(const char *letters) {
+  for(; *letters; letters++) tap(letter(*letters));
+}
+
+void record(Key slot, const char *letters) {
+  tap(Key_MacroRec);
+  tap(slot);
+  type(letters);
+  tap(Key_MacroRec);
+}
+
+void play(Key slot) {
+  tap(Key_MacroPlay);
+  tap(slot);
+  settle();
+}
+
+void note(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  printf("# ");
+  vprintf(format, args);
+  printf("\n");
+  va_end(args);
+}
+
+uint32_t now() {
+  return clock_us;
+}
+
+void setPollInterval(uint32_t us, uint32_t timeout) {
+  if(pending) deliver(pendingReport);  // as if the host collected it just now
+  pending = false;
+  pollInterval = us;
+  pollTimeout = timeout;
+  if(us) nextPoll = (clock_us / us + 1) * us;
+}
+
+std::string takeTyped() {
+  std::string letters;
+  letters.swap(typed);
+  return letters;
+}
+
+}
@@ -0,0 +1,109 @@
+/* -*- mode: c++ -*-
+ * Kaleidoscope-MacrosOnTheFly -- Record and play back macros on-the-fly.
+ * Copyright (C) 2017  Craig Disselkoen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <Kaleidoscope-MacrosOnTheFly.h>
+
+#include <string>
+
+/* Host test harness
+ * Runs the plugin (built with ARDUINO_VIRTUAL, against the stand-ins in
+ *   stubs/) inside a tiny model of the Kaleidoscope scan loop: each cycle
+ *   delivers the scripted key events, runs beforeReportingState(), sends the
+ *   HID report, then runs afterEachCycle().  Every report that differs from the previous one is
+ *   printed, so the output (together with the plugin's own debug_print()
+ *   lines, including its per-macro report/event/cycle counts) is a trace
+ *   that can be compared against a stored golden copy.
+ * Physical keys are held from press() until release(); like the real
+ *   keyboard, held keys are delivered again every cycle until released, and
+ *   keys the plugin masks are ignored until they are released.
+ */
+namespace harness {
+
+/* Start over with a fresh plugin using 'storageSize' bytes of storage, and
+ *   with blank EEPROM.  If 'banks' is nonzero, setupPersistence(banks) is
+ *   called.  colorEffects is turned off, since LEDs aren't traced.
+ */
+void reset(uint16_t storageSize = kaleidoscope::MacrosOnTheFly::DEFAULT_STORAGE_SIZE_IN_BYTES,
+           uint8_t banks = 0);
+
+/* Like reset(), but keeping the EEPROM contents, as if the keyboard had been
+ *   unplugged and plugged back in.
+ */
+void powerCycle();
+
+kaleidoscope::MacrosOnTheFly &plugin();
+
+/* Add a second instance of the plugin, with its own 'storageSize' bytes of
+ *   storage and its own keys, handled after the first (as if listed after it
+ *   in KALEIDOSCOPE_INIT_PLUGINS).  It lasts until the next reset().
+ */
+kaleidoscope::MacrosOnTheFly &addInstance(uint16_t storageSize, Key recKey, Key playKey);
+
+/* Physical key presses and releases; these take effect at the next cycle */
+void press(Key key);
+void release(Key key);
+
+/* Run the given number of scan cycles */
+void cycle(uint16_t count = 1);
+
+/* Run cycles until no report has changed for a while (e.g. until playback
+ *   has finished)
+ */
+void settle();
+
+/* Helpers for scripts: tap() presses a key for one cycle; type() taps each
+ *   of the letters a-z in the string; record() and play() tap the keys to
+ *   record those letters into / play back the given slot, and play() also
+ *   settles afterwards.
+ */
+Key letter(char c);
+void tap(Key key);
+void type(const char *letters);
+void record(Key slot, const char *letters);
+void play(Key slot);
+
+/* Print a comment line ("# ...") into the trace */
+void note(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+/* The model's clock, in microseconds.  Each cycle takes CYCLE_US, and each
+ *   report sent takes REPORT_US.
+ */
+static const uint32_t CYCLE_US = 1000;
+static const uint32_t REPORT_US = 100;
+uint32_t now();
+
+/* Model a slow host (or KVM etc) which only polls the keyboard every 'us'
+ *   microseconds.  The endpoint holds one report: sending a new report
+ *   before the host has collected the previous one blocks until the next
+ *   poll, as sendReport() does on the keyboard; but for no longer than
+ *   'timeout' microseconds.  After that the new report overwrites the one
+ *   waiting, which the host never sees (the trace shows it as "lost").  A
+ *   KVM which takes reports as fast as they come, but only passes one on
+ *   every 'us', is the same as a timeout of 0.
+ * 0 goes back to a host which is always ready, and each report takes
+ *   REPORT_US.
+ * As on the keyboard, reports identical to the last one aren't sent at all.
+ */
+void setPollInterval(uint32_t us, uint32_t timeout = UINT32_MAX);
+
+/* The letters the host has seen pressed, in order, since the last call */
+std::string takeTyped();
+
+}
@@ -0,0 +1,9 @@
+/* stand-in; see Kaleidoscope.h */
+#pragma once
+#include <Kaleidoscope.h>
+
+class EEPROMSettings_ {
+ public:
+  uint16_t requestSlice(uint16_t size);
+};
+extern EEPROMSettings_ EEPROMSettings;
@@ -0,0 +1,18 @@
+/* stand-in; see Kaleidoscope.h.  LEDs aren't traced, so these do nothing. */
+#pragma once
+#include <Kaleidoscope.h>
+
+struct cRGB {
+  uint8_t b, g, r;
+};
+#define CRGB(r,g,b) (cRGB){b, g, r}
+
+class LEDControl_ {
+ public:
+  void set_all_leds_to(cRGB) {}
+  void setCrgbAt(uint8_t, uint8_t, cRGB) {}
+  void setCrgbAt(KeyAddr, cRGB) {}
+  void refreshAll() {}
+  void refreshAt(uint8_t, uint8_t) {}
+};
+extern LEDControl_ LEDControl;
@@ -0,0 +1,11 @@
+/* stand-in; see Kaleidoscope.h */
+#pragma once
+#include <stdint.h>
+
+namespace kaleidoscope {
+namespace ranges {
+enum : uint16_t {
+  KALEIDOSCOPE_SAFE_START = 0xc000,
+};
+}
+}
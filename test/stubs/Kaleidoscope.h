@@ -0,0 +1,123 @@
+/* -*- mode: c++ -*-
+ * Kaleidoscope-MacrosOnTheFly -- Record and play back macros on-the-fly.
+ * Copyright (C) 2017  Craig Disselkoen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* A minimal stand-in for the parts of Kaleidoscope this plugin uses, so that
+ *   it can be built and driven on the host by the test harness (see
+ *   ../harness.h).  Only what the plugin actually touches is here; the
+ *   harness supplies the implementations.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+typedef uint8_t byte;
+
+struct Key {
+  uint16_t raw;
+  uint16_t getRaw() const { return raw; }
+  void setRaw(uint16_t r) { raw = r; }
+  uint8_t getFlags() const { return raw >> 8; }
+  void setFlags(uint8_t f) { raw = (raw & 0xff) | (f << 8); }
+  uint8_t getKeyCode() const { return raw & 0xff; }
+  bool operator==(const Key &o) const { return raw == o.raw; }
+  bool operator!=(const Key &o) const { return raw != o.raw; }
+};
+
+#define CTRL_HELD        0x01
+#define LALT_HELD        0x02
+#define RALT_HELD        0x04
+#define SHIFT_HELD       0x08
+#define GUI_HELD         0x10
+#define SWITCH_TO_KEYMAP 0x04
+#define SYNTHETIC        0x40
+
+// HID usage codes, as in Kaleidoscope
+static const Key Key_NoKey = {0};
+static const Key Key_A = {0x04}, Key_B = {0x05}, Key_C = {0x06}, Key_D = {0x07},
+  Key_E = {0x08}, Key_F = {0x09}, Key_G = {0x0a}, Key_H = {0x0b}, Key_I = {0x0c},
+  Key_J = {0x0d}, Key_K = {0x0e}, Key_L = {0x0f}, Key_M = {0x10}, Key_N = {0x11},
+  Key_O = {0x12}, Key_P = {0x13}, Key_Q = {0x14}, Key_R = {0x15}, Key_S = {0x16},
+  Key_T = {0x17}, Key_U = {0x18}, Key_V = {0x19}, Key_W = {0x1a}, Key_X = {0x1b},
+  Key_Y = {0x1c}, Key_Z = {0x1d};
+static const Key Key_LeftControl = {0xe0}, Key_LeftShift = {0xe1},
+  Key_LeftAlt = {0xe2}, Key_LeftGui = {0xe3}, Key_RightControl = {0xe4},
+  Key_RightShift = {0xe5}, Key_RightAlt = {0xe6}, Key_RightGui = {0xe7};
+
+#define IS_PRESSED  0x01
+#define WAS_PRESSED 0x02
+#define INJECTED    0x10
+
+inline bool keyIsPressed(uint8_t state) { return state & IS_PRESSED; }
+inline bool keyWasPressed(uint8_t state) { return state & WAS_PRESSED; }
+inline bool keyToggledOn(uint8_t state) { return keyIsPressed(state) && !keyWasPressed(state); }
+inline bool keyToggledOff(uint8_t state) { return !keyIsPressed(state) && keyWasPressed(state); }
+
+struct KeyAddr {
+  uint8_t r, c;
+  uint8_t row() const { return r; }
+  uint8_t col() const { return c; }
+};
+static const KeyAddr UnknownKeyswitchLocation = {0xff, 0xff};
+
+void handleKeyswitchEvent(Key mappedKey, KeyAddr key_addr, uint8_t keyState);
+unsigned long micros();
+
+namespace kaleidoscope {
+
+enum class EventHandlerResult { OK, EVENT_CONSUMED, ABORT };
+
+class Plugin {};
+
+namespace hid {
+class Keyboard {
+ public:
+  void sendReport();
+  void releaseAllKeys();
+  void releaseKey(Key key);
+  bool wasModifierKeyActive(Key key);
+};
+class HID {
+ public:
+  Keyboard &keyboard();
+};
+}
+
+class Storage {
+ public:
+  uint8_t read(int offset);
+  void update(int offset, uint8_t value);
+  void commit();
+};
+
+class Device {
+ public:
+  void maskKey(KeyAddr key_addr);
+};
+
+class Runtime {
+ public:
+  hid::HID &hid();
+  Device &device();
+  Storage &storage();
+};
+
+}
+
+extern kaleidoscope::Runtime Kaleidoscope;
@@ -0,0 +1,3 @@
+/* stand-in; see ../Kaleidoscope.h */
+#pragma once
+#include <Kaleidoscope.h>
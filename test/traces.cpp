@@ -0,0 +1,315 @@
+/* -*- mode: c++ -*-
+ * Kaleidoscope-MacrosOnTheFly -- Record and play back macros on-the-fly.
+ * Copyright (C) 2017  Craig Disselkoen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Golden-trace scenarios
+ * `traces` with no arguments lists the scenarios; `traces <name>` runs one
+ *   and prints its trace, which `make test` compares against golden/<name>.txt.
+ * To add a scenario, add a function and a line to the table at the bottom,
+ *   then run `make update-golden` and check the new trace by hand.
+ */
+
+#include "harness.h"
+
+#include <string.h>
+
+using namespace harness;
+
+static void record_and_play() {
+  reset();
+  note("record \"hello\" into q");
+  record(Key_Q, "hello");
+  note("play q");
+  play(Key_Q);
+  note("double-tap MacroPlay replays the last macro");
+  tap(Key_MacroPlay);
+  tap(Key_MacroPlay);
+  settle();
+  note("play an empty slot");
+  play(Key_W);
+}
+
+static void held_modifiers() {
+  reset();
+  note("record shift+h, i into q");
+  tap(Key_MacroRec);
+  tap(Key_Q);
+  press(Key_LeftShift);
+  cycle();
+  tap(Key_H);
+  release(Key_LeftShift);
+  cycle();
+  type("i");
+  tap(Key_MacroRec);
+  play(Key_Q);
+}
+
+static void modifier_slots() {
+  reset();
+  note("shift+q and q are different slots");
+  tap(Key_MacroRec);
+  press(Key_LeftShift);
+  cycle();
+  tap(Key_Q);
+  release(Key_LeftShift);
+  cycle();
+  type("up");
+  tap(Key_MacroRec);
+  record(Key_Q, "down");
+  note("play shift+q");
+  tap(Key_MacroPlay);
+  press(Key_LeftShift);
+  cycle();
+  tap(Key_Q);
+  release(Key_LeftShift);
+  settle();
+  note("play q");
+  play(Key_Q);
+}
+
+static void nested() {
+  reset();
+  note("n = x pressed, and still held when recording stops");
+  tap(Key_MacroRec);
+  tap(Key_N);
+  press(Key_X);
+  cycle();
+  tap(Key_MacroRec);
+  release(Key_X);
+  cycle();
+  note("o = play n, y, z");
+  tap(Key_MacroRec);
+  tap(Key_O);
+  tap(Key_MacroPlay);
+  tap(Key_N);
+  type("yz");
+  tap(Key_MacroRec);
+  note("x must be released when n ends, not held under y and z");
+  play(Key_O);
+  note("p = play, shift down, w (an empty slot), a-h, shift up, c");
+  tap(Key_MacroRec);
+  tap(Key_P);
+  tap(Key_MacroPlay);
+  press(Key_LeftShift);
+  cycle();
+  type("wabcdefgh");
+  release(Key_LeftShift);
+  cycle();
+  type("c");
+  tap(Key_MacroRec);
+  note("shift isn't a slot, so it is passed through, and stays held for a-h");
+  play(Key_P);
+}
+
+static void nested_empty_slot() {
+  reset();
+  note("p = a, b, c, play e (an empty slot), y");
+  tap(Key_MacroRec);
+  tap(Key_P);
+  type("abc");
+  tap(Key_MacroPlay);
+  tap(Key_E);
+  type("y");
+  tap(Key_MacroRec);
+  note("e chooses a slot, so must never be sent itself");
+  play(Key_P);
+}
+
+static void held_across_playback() {
+  reset();
+  record(Key_Q, "abcdefghijklmnopqrstuvwxyz");
+  note("hold x while q plays: x stays in every report, apart from when the macro itself releases x");
+  press(Key_X);
+  cycle();
+  tap(Key_MacroPlay);
+  tap(Key_Q);
+  settle();
+  release(Key_X);
+  settle();
+}
+
+static void concurrent() {
+  reset();
+  record(Key_A, "abcdefghijklmnopqrst");
+  record(Key_B, "xyz");
+  note("start a, then b while a is still playing");
+  tap(Key_MacroPlay);
+  tap(Key_A);
+  tap(Key_MacroPlay);
+  tap(Key_B);
+  settle();
+}
+
+static void slow_host() {
+  reset();
+  record(Key_Q, "abcdefghijklmnopqrst");
+  note("host polls every 8ms: playback backs off, but sends every keystroke");
+  setPollInterval(8000);
+  takeTyped();
+  tap(Key_MacroPlay);
+  tap(Key_Q);
+  cycle(10);
+  note("the rest of the keyboard keeps working meanwhile");
+  tap(Key_Z);
+  settle();
+  note("host typed \"%s\"", takeTyped().c_str());
+  note("interval now %lu us", (unsigned long)plugin().playbackReportInterval());
+  note("fast host again: the interval ramps back down to 0");
+  setPollInterval(0);
+  uint8_t plays = 0;
+  do {
+    play(Key_Q);
+    plays++;
+  } while(plugin().playbackReportInterval() > 0 && plays < 20);
+  note("interval %lu us after %u more plays", (unsigned long)plugin().playbackReportInterval(), plays);
+}
+
+static void kvm() {
+  reset();
+  record(Key_Q, "mississippi");
+  note("a KVM passes on one report every 8ms, and keeps only the latest");
+  setPollInterval(8000, 0);
+  takeTyped();
+  play(Key_Q);
+  note("host typed \"%s\"", takeTyped().c_str());
+  note("pacing can't see that, so it needs a minimum interval");
+  plugin().minPlaybackReportInterval = 8500;
+  play(Key_Q);
+  note("host typed \"%s\"", takeTyped().c_str());
+}
+
+static void two_instances() {
+  reset();
+  const Key otherRec = Key{uint16_t(kaleidoscope::ranges::KALEIDOSCOPE_SAFE_START + 2)};
+  const Key otherPlay = Key{uint16_t(kaleidoscope::ranges::KALEIDOSCOPE_SAFE_START + 3)};
+  addInstance(100, otherRec, otherPlay);
+  note("a second instance, with its own keys, keeps its own macros");
+  record(Key_Q, "abc");
+  tap(otherRec);
+  tap(Key_Q);
+  type("xyz");
+  tap(otherRec);
+  play(Key_Q);
+  tap(otherPlay);
+  tap(Key_Q);
+  settle();
+}
+
+static void persistence() {
+  reset(kaleidoscope::MacrosOnTheFly::DEFAULT_STORAGE_SIZE_IN_BYTES, 2);
+  record(Key_Q, "hello");
+  record(Key_W, "world");
+  note("a third macro doesn't get a bank, and is lost on power loss");
+  record(Key_E, "extra");
+  cycle(500);  // give the writebacks time to finish
+  note("power cycle");
+  powerCycle();
+  play(Key_W);
+  play(Key_Q);
+  play(Key_E);
+  note("re-recording a slot replaces its bank");
+  record(Key_Q, "bye");
+  cycle(500);
+  powerCycle();
+  play(Key_Q);
+}
+
+static void rerecord() {
+  reset();
+  note("record a, b, c, then re-record b longer");
+  record(Key_A, "ab");
+  record(Key_B, "cd");
+  record(Key_C, "ef");
+  record(Key_B, "ghijkl");
+  play(Key_C);
+  play(Key_A);
+  play(Key_B);
+}
+
+static void out_of_space() {
+  reset(40);
+  note("recording stops, and is thrown away, when storage runs out");
+  tap(Key_MacroRec);
+  tap(Key_Q);
+  type("abcdefghij");
+  play(Key_Q);
+  note("what fits can still be recorded afterwards");
+  record(Key_Q, "abc");
+  play(Key_Q);
+  note("storage too small for a single keystroke: nothing is recorded, but our keys still work");
+  reset(8);
+  tap(Key_MacroRec);
+  tap(Key_Q);
+  type("ab");
+  play(Key_Q);
+}
+
+static void grow_by_evicting() {
+  reset(60, 8);
+  note("record and play a-e, so that storage is full of clean slots");
+  const char *slots = "abcde";
+  for(const char *c = slots; *c; c++) {
+    const char macro[] = {*c, '\0'};
+    record(letter(*c), macro);
+    cycle(500);  // give the writeback time to finish
+    play(letter(*c));
+  }
+  note("a long recording evicts whichever slots it needs, not just its neighbour");
+  record(Key_F, "abcdefghijkl");
+  play(Key_F);
+  play(Key_E);
+  note("the last macro played can be evicted, and is faulted back in to replay it");
+  record(Key_G, "abcdefghijkl");
+  cycle(500);
+  tap(Key_MacroPlay);
+  tap(Key_MacroPlay);
+  settle();
+}
+
+static const struct {
+  const char *name;
+  void (*run)();
+} scenarios[] = {
+  {"record_and_play", record_and_play},
+  {"held_modifiers", held_modifiers},
+  {"modifier_slots", modifier_slots},
+  {"nested", nested},
+  {"nested_empty_slot", nested_empty_slot},
+  {"held_across_playback", held_across_playback},
+  {"concurrent", concurrent},
+  {"slow_host", slow_host},
+  {"kvm", kvm},
+  {"two_instances", two_instances},
+  {"persistence", persistence},
+  {"rerecord", rerecord},
+  {"out_of_space", out_of_space},
+  {"grow_by_evicting", grow_by_evicting},
+};
+
+int main(int argc, char **argv) {
+  for(const auto &scenario : scenarios) {
+    if(argc < 2) {
+      printf("%s\n", scenario.name);
+    } else if(strcmp(argv[1], scenario.name) == 0) {
+      scenario.run();
+      return 0;
+    }
+  }
+  if(argc < 2) return 0;
+  fprintf(stderr, "no scenario named %s\n", argv[1]);
+  return 1;
+}